@@ -0,0 +1,386 @@
+// Capture path micro-benchmarks: the capture -> encode handoff, FrameRing
+// against the mutex/condvar FrameQueue it replaced (frames are never touched,
+// so this measures only the queue), and the picture transform kernels.
+//
+//   make bench && ./frame_bench
+//
+// throughput: the producer pushes back to back, the consumer pops as fast as
+//             it can; the blocking push keeps the ring from dropping.
+// latency:    one frame per interval, the time from push to pop returning.
+//             With a long interval the consumer is parked when the frame
+//             arrives, which is what capture at 30 fps looks like.
+// mirror:     each horizontal mirror kernel on a 1280x1024 NV12 frame, after
+//             checking it against a plain per-pixel reference for every row
+//             length up to 1300. memcpy of the same frame is the floor.
+// transform:  transform_picture() for every rotation with and without the
+//             mirror, against the per-pixel reference it is checked with.
+// log:        with make ALLOC_STATS=1, heap allocations per frame of the
+//             per-frame DEBUG statements at INFO level, as std::string
+//             concatenation (before LOGF) and as LOGF.
+
+#define STREAMER_NO_MAIN
+#include "streamout.cpp"
+
+namespace {
+
+// The queue VideoStreamer used before FrameRing, kept here as the baseline
+struct FrameQueue {
+    std::queue<AVFrame*> queue;
+    std::mutex mtx;
+    std::condition_variable cond;
+    std::atomic<bool> quit{false};
+
+    void push(AVFrame* frame) {
+        std::lock_guard<std::mutex> lock(mtx);
+        queue.push(frame);
+        cond.notify_one();
+    }
+
+    AVFrame* pop() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (queue.empty() && !quit) {
+            cond.wait(lock);
+        }
+        if (quit) return nullptr;
+        AVFrame* frame = queue.front();
+        queue.pop();
+        return frame;
+    }
+};
+
+struct RingAdapter {
+    FrameRing ring;
+    explicit RingAdapter(size_t capacity) { ring.init(capacity); }
+    void push(AVFrame* frame) { ring.push_blocking(frame); }
+    AVFrame* pop() { return ring.pop(); }
+};
+
+struct QueueAdapter {
+    FrameQueue queue;
+    explicit QueueAdapter(size_t) {}
+    void push(AVFrame* frame) { queue.push(frame); }
+    AVFrame* pop() { return queue.pop(); }
+};
+
+int64_t now_ns() {
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Frames are stand-ins: index + 1 cast to a pointer, never dereferenced
+AVFrame* token(size_t i) { return reinterpret_cast<AVFrame*>(i + 1); }
+size_t index_of(AVFrame* frame) { return reinterpret_cast<size_t>(frame) - 1; }
+
+template <typename Q>
+double throughput(size_t count, size_t capacity) {
+    Q q(capacity);
+    int64_t start = now_ns();
+    std::thread consumer([&] {
+        for (size_t i = 0; i < count; i++) q.pop();
+    });
+    for (size_t i = 0; i < count; i++) q.push(token(i));
+    consumer.join();
+    return count * 1e3 / (now_ns() - start);  // million frames per second
+}
+
+template <typename Q>
+std::vector<int64_t> latency(size_t count, size_t capacity, int64_t interval_ns) {
+    Q q(capacity);
+    std::vector<int64_t> pushed(count), popped(count);
+    std::thread consumer([&] {
+        for (size_t i = 0; i < count; i++) {
+            AVFrame* frame = q.pop();
+            popped[index_of(frame)] = now_ns();
+        }
+    });
+    int64_t next = now_ns();
+    for (size_t i = 0; i < count; i++) {
+        next += interval_ns;
+        while (now_ns() < next) std::this_thread::sleep_for(nanoseconds(next - now_ns()));
+        pushed[i] = now_ns();
+        q.push(token(i));
+    }
+    consumer.join();
+    std::vector<int64_t> result(count);
+    for (size_t i = 0; i < count; i++) result[i] = popped[i] - pushed[i];
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+void report_latency(const char* name, const std::vector<int64_t>& ns) {
+    auto at = [&](double q) { return ns[std::min(ns.size() - 1, static_cast<size_t>(q * ns.size()))] / 1000.0; };
+    printf("  %-10s p50 %8.1f us  p99 %8.1f us  p999 %8.1f us  max %8.1f us\n",
+           name, at(0.50), at(0.99), at(0.999), ns.back() / 1000.0);
+}
+
+// Median time of one call, after a warm-up call
+template <typename F>
+double median_us(int iterations, F&& run) {
+    std::vector<int64_t> ns(iterations);
+    run();
+    for (int i = 0; i < iterations; i++) {
+        int64_t start = now_ns();
+        run();
+        ns[i] = now_ns() - start;
+    }
+    std::sort(ns.begin(), ns.end());
+    return ns[iterations / 2] / 1000.0;
+}
+
+// One plane, width in units of 1 byte (Y, U, V) or 2 bytes (NV12 UV pairs)
+struct Plane {
+    int width, height, unit;
+    ptrdiff_t stride;
+    std::vector<uint8_t> data;
+
+    Plane(int w, int h, int u) : width(w), height(h), unit(u), stride((w * u + 31) & ~31), data(stride * h) {}
+    uint8_t* at(int x, int y) { return data.data() + y * stride + x * unit; }
+    const uint8_t* at(int x, int y) const { return data.data() + y * stride + x * unit; }
+
+    void fill(uint32_t seed) {
+        for (uint8_t& byte : data) {
+            seed = seed * 1664525u + 1013904223u;
+            byte = seed >> 24;
+        }
+    }
+
+    // Compares the picture, not the padding
+    bool same(const Plane& other) const {
+        for (int y = 0; y < height; y++) {
+            if (memcmp(at(0, y), other.at(0, y), width * unit) != 0) return false;
+        }
+        return true;
+    }
+};
+
+// What transform_plane() must produce: rotate clockwise, then mirror
+void reference_transform(Plane& dst, const Plane& src, int rotation, bool mirror) {
+    for (int r = 0; r < dst.height; r++) {
+        for (int c = 0; c < dst.width; c++) {
+            int cc = mirror ? dst.width - 1 - c : c;
+            int sx = cc, sy = r;
+            switch (rotation) {
+                case 90:  sx = r;                  sy = src.height - 1 - cc; break;
+                case 180: sx = src.width - 1 - cc; sy = src.height - 1 - r;  break;
+                case 270: sx = src.width - 1 - r;  sy = cc;                  break;
+            }
+            memcpy(dst.at(c, r), src.at(sx, sy), dst.unit);
+        }
+    }
+}
+
+void reference_mirror_row(uint8_t* dst, const uint8_t* src, int units, int unit) {
+    for (int i = 0; i < units; i++) memcpy(dst + i * unit, src + (units - 1 - i) * unit, unit);
+}
+
+struct MirrorCandidate {
+    const char* name;
+    MirrorRowFn bytes;
+    MirrorRowFn pairs;
+};
+
+std::vector<MirrorCandidate> mirror_candidates() {
+    std::vector<MirrorCandidate> kernels = {{"scalar", mirror_row_scalar<1>, mirror_row_scalar<2>}};
+#if defined(__SSE2__)
+    kernels.push_back({"sse2", mirror_row_sse2<1>, mirror_row_sse2<2>});
+    if (__builtin_cpu_supports("avx2")) kernels.push_back({"avx2", mirror_row_avx2<1>, mirror_row_avx2<2>});
+#elif defined(__ARM_NEON)
+    kernels.push_back({"neon", mirror_row_neon<1>, mirror_row_neon<2>});
+#endif
+    return kernels;
+}
+
+bool check_mirror_kernel(const MirrorCandidate& kernel) {
+    std::vector<uint8_t> src(2 * 1300 + 64), out(src.size()), want(src.size());
+    for (size_t i = 0; i < src.size(); i++) src[i] = static_cast<uint8_t>(i * 7 + 3);
+    for (int unit = 1; unit <= 2; unit++) {
+        MirrorRowFn row = unit == 1 ? kernel.bytes : kernel.pairs;
+        for (int units = 1; units <= 1300; units++) {
+            // Odd offset, the capture path doesn't promise aligned rows
+            row(out.data(), src.data() + 1, units);
+            reference_mirror_row(want.data(), src.data() + 1, units, unit);
+            if (memcmp(out.data(), want.data(), units * unit) != 0) {
+                printf("  %s: wrong output at %d units of %d bytes\n", kernel.name, units, unit);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// NV12 or YUV420P as transform_picture() takes it
+struct Picture {
+    AVPixelFormat format;
+    std::vector<Plane> planes;
+
+    Picture(AVPixelFormat fmt, int width, int height) : format(fmt) {
+        int cw = (width + 1) / 2, ch = (height + 1) / 2;
+        planes.emplace_back(width, height, 1);
+        if (fmt == AV_PIX_FMT_NV12) {
+            planes.emplace_back(cw, ch, 2);
+        } else {
+            planes.emplace_back(cw, ch, 1);
+            planes.emplace_back(cw, ch, 1);
+        }
+    }
+
+    void pointers(uint8_t* data[4], int linesize[4]) {
+        for (int p = 0; p < 4; p++) {
+            data[p] = p < static_cast<int>(planes.size()) ? planes[p].data.data() : nullptr;
+            linesize[p] = p < static_cast<int>(planes.size()) ? static_cast<int>(planes[p].stride) : 0;
+        }
+    }
+};
+
+Picture rotated_like(const Picture& src, int rotation) {
+    const Plane& luma = src.planes[0];
+    bool swap = rotation == 90 || rotation == 270;
+    return Picture(src.format, swap ? luma.height : luma.width, swap ? luma.width : luma.height);
+}
+
+void transform(Picture& dst, Picture& src, int rotation, bool mirror) {
+    uint8_t* dst_data[4];
+    uint8_t* src_data[4];
+    int dst_linesize[4], src_linesize[4];
+    dst.pointers(dst_data, dst_linesize);
+    src.pointers(src_data, src_linesize);
+    transform_picture(dst_data, dst_linesize, src_data, src_linesize, src.format,
+                      src.planes[0].width, src.planes[0].height, rotation, mirror);
+}
+
+void reference_transform(Picture& dst, const Picture& src, int rotation, bool mirror) {
+    for (size_t p = 0; p < src.planes.size(); p++) {
+        reference_transform(dst.planes[p], src.planes[p], rotation, mirror);
+    }
+}
+
+bool check_transforms() {
+    const int sizes[][2] = {{1, 1}, {2, 2}, {7, 5}, {9, 17}, {63, 65}, {640, 512}, {1280, 1024}};
+    for (AVPixelFormat format : {AV_PIX_FMT_NV12, AV_PIX_FMT_YUV420P}) {
+        for (const auto& size : sizes) {
+            Picture src(format, size[0], size[1]);
+            for (size_t p = 0; p < src.planes.size(); p++) src.planes[p].fill(p + 1);
+            for (int rotation : {0, 90, 180, 270}) {
+                for (bool mirror : {false, true}) {
+                    Picture out = rotated_like(src, rotation), want = rotated_like(src, rotation);
+                    transform(out, src, rotation, mirror);
+                    reference_transform(want, src, rotation, mirror);
+                    for (size_t p = 0; p < out.planes.size(); p++) {
+                        if (!out.planes[p].same(want.planes[p])) {
+                            printf("  wrong output: %s %dx%d rotate %d%s, plane %zu\n",
+                                   av_get_pix_fmt_name(format), size[0], size[1], rotation,
+                                   mirror ? " mirror" : "", p);
+                            return false;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void bench_mirror(int iterations) {
+    printf("mirror, 1280x1024 NV12, median of %d frames:\n", iterations);
+    Plane y(1280, 1024, 1), uv(640, 512, 2);
+    Plane y_out(1280, 1024, 1), uv_out(640, 512, 2);
+    y.fill(1);
+    uv.fill(2);
+    double copy_us = median_us(iterations, [&] {
+        copy_plane(y_out.data.data(), y_out.stride, y.data.data(), y.stride, 1280, 1024);
+        copy_plane(uv_out.data.data(), uv_out.stride, uv.data.data(), uv.stride, 1280, 512);
+    });
+    printf("  %-10s %8.1f us\n", "memcpy", copy_us);
+    for (const MirrorCandidate& kernel : mirror_candidates()) {
+        if (!check_mirror_kernel(kernel)) continue;
+        double us = median_us(iterations, [&] {
+            mirror_plane(kernel.bytes, y_out.data.data(), y_out.stride, y.data.data(), y.stride, 1280, 1024);
+            mirror_plane(kernel.pairs, uv_out.data.data(), uv_out.stride, uv.data.data(), uv.stride, 640, 512);
+        });
+        printf("  %-10s %8.1f us  (matches reference)\n", kernel.name, us);
+    }
+}
+
+void bench_transform(int iterations) {
+    printf("transform_picture, 1280x1024 NV12, %s mirror kernels, median of %d frames:\n",
+           mirror_kernels().name, iterations);
+    printf("  %s\n", check_transforms() ? "all rotations and mirrors match the reference, NV12 and YUV420P, 1x1 to 1280x1024"
+                                        : "MISMATCH, timings below are of broken code");
+    Picture src(AV_PIX_FMT_NV12, 1280, 1024);
+    src.planes[0].fill(1);
+    src.planes[1].fill(2);
+    for (bool mirror : {false, true}) {
+        for (int rotation : {0, 90, 180, 270}) {
+            Picture out = rotated_like(src, rotation);
+            double us = median_us(iterations, [&] { transform(out, src, rotation, mirror); });
+            double ref_us = median_us(std::max(iterations / 10, 3), [&] { reference_transform(out, src, rotation, mirror); });
+            printf("  rotate %3d%-7s %8.1f us   reference %8.1f us\n", rotation, mirror ? " mirror" : "", us, ref_us);
+        }
+    }
+}
+
+#ifdef STREAMER_COUNT_ALLOCS
+// The per-frame DEBUG statements of capture, encode and send, as they were
+// written before LOGF: the message is built before log() checks the level
+void log_frame_concat(int64_t pts, int64_t us) {
+    g_logger.log(LOG_DEBUG, std::string("Captured frame PTS: ") + std::to_string(pts) +
+              " | Capture time: " + std::to_string(us) + "us");
+    g_logger.log(LOG_DEBUG, "Processing frame with filter");
+    g_logger.log(LOG_DEBUG, std::string("Filtered frame PTS: ") + std::to_string(pts) +
+              " | Filter time: " + std::to_string(us) + "us");
+    g_logger.log(LOG_DEBUG, std::string("Encoded packet PTS: ") + std::to_string(pts) +
+              " | Encode time: " + std::to_string(us) + "us");
+    g_logger.log(LOG_DEBUG, std::string("Sent packet PTS: ") + std::to_string(pts) +
+              " | Send time: " + std::to_string(us) + "us");
+}
+
+void log_frame_logf(int64_t pts, int64_t us) {
+    LOGF(LOG_DEBUG, "Captured frame PTS: ", pts, " | Capture time: ", us, "us");
+    LOGF(LOG_DEBUG, "Processing frame with filter");
+    LOGF(LOG_DEBUG, "Filtered frame PTS: ", pts, " | Filter time: ", us, "us");
+    LOGF(LOG_DEBUG, "Encoded packet PTS: ", pts, " | Encode time: ", us, "us");
+    LOGF(LOG_DEBUG, "Sent packet PTS: ", pts, " | Send time: ", us, "us");
+}
+
+template <typename F>
+double allocs_per_frame(int frames, F&& log_frame) {
+    uint64_t before = heap_allocs();
+    // Realistic magnitudes, pts in microseconds an hour in
+    for (int i = 0; i < frames; i++) log_frame(3600000000LL + i * 33333, 1000 + i % 5000);
+    return static_cast<double>(heap_allocs() - before) / frames;
+}
+
+void bench_log_allocs(int frames) {
+    g_logger.init("", LOG_INFO, false, false);
+    printf("heap allocations per frame, DEBUG statements at INFO level, %d frames:\n", frames);
+    printf("  %-10s %6.2f\n", "concat", allocs_per_frame(frames, log_frame_concat));
+    printf("  %-10s %6.2f\n", "LOGF", allocs_per_frame(frames, log_frame_logf));
+}
+#endif
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    size_t count = argc > 1 ? strtoull(argv[1], nullptr, 10) : 2000000;
+    size_t samples = argc > 2 ? strtoull(argv[2], nullptr, 10) : 2000;
+    const size_t capacity = 8;  // Config::frame_queue_depth default
+
+    // FrameQueue is unbounded, so the producer never waits; a deep ring is the closer match
+    printf("throughput, %zu frames:\n", count);
+    printf("  FrameQueue          %8.2f M frames/s\n", throughput<QueueAdapter>(count, capacity));
+    printf("  FrameRing (%4zu)    %8.2f M frames/s\n", capacity, throughput<RingAdapter>(count, capacity));
+    printf("  FrameRing (%4d)    %8.2f M frames/s\n", 1024, throughput<RingAdapter>(count, 1024));
+
+    for (int64_t interval_us : {100, 1000, 33333}) {
+        size_t n = interval_us > 10000 ? std::min<size_t>(samples, 150) : samples;
+        printf("handoff latency, one frame every %lld us, %zu frames:\n", static_cast<long long>(interval_us), n);
+        report_latency("FrameQueue", latency<QueueAdapter>(n, capacity, interval_us * 1000));
+        report_latency("FrameRing", latency<RingAdapter>(n, capacity, interval_us * 1000));
+    }
+
+    bench_mirror(200);
+    bench_transform(100);
+#ifdef STREAMER_COUNT_ALLOCS
+    bench_log_allocs(10000);
+#endif
+    return 0;
+}
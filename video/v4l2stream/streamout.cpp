@@ -14,17 +14,50 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <linux/videodev2.h>
+#include <linux/futex.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <dirent.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <getopt.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <array>
+#include <charconv>
+#include <type_traits>
+#include <cstring>
+#include <climits>
+#include <cmath>
+#include <map>
+#include <deque>
+#include <sstream>
+#include <random>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavdevice/avdevice.h>
 #include <libavformat/avformat.h>
+#include <libavutil/base64.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/opt.h>
-#include <libavfilter/avfilter.h>
-#include <libavfilter/buffersrc.h>
-#include <libavfilter/buffersink.h>
 #include <libavutil/pixdesc.h>
 }
 
@@ -50,6 +83,51 @@ private:
     bool console_output_ = true;
     bool file_output_ = false;
 
+    // Timestamp string, only re-rendered when the second changes
+    time_t cached_sec_ = -1;
+    char cached_time_[32] = {0};
+
+    // Async mode: every logging thread owns a SPSC ring of fixed-size records,
+    // the writer thread drains them, formats and writes in batches. A full
+    // ring drops the record rather than ever blocking the caller. A thread's
+    // ring is retired when the thread exits; the writer drains it one last
+    // time and keeps a few spares for the next threads, so threads that come
+    // and go (RTSP viewers) don't grow the list.
+    static constexpr size_t kRecordText = 232;
+    static constexpr size_t kRingRecords = 512;
+    static constexpr size_t kSpareRings = 4;
+
+    struct LogRecord {
+        int64_t time_us;
+        LogLevel level;
+        uint32_t length;
+        char text[kRecordText];
+    };
+
+    struct LogRing {
+        LogRecord records[kRingRecords];
+        alignas(64) std::atomic<uint64_t> head{0};
+        alignas(64) std::atomic<uint64_t> tail{0};
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<bool> retired{false};   // owner thread exited, set after its last record
+    };
+
+    // Thread exit hook for the ring of the thread it belongs to
+    struct RingOwner {
+        LogRing* ring = nullptr;
+        ~RingOwner() {
+            if (ring) ring->retired.store(true, std::memory_order_release);
+        }
+    };
+
+    bool initialized_ = false;
+    bool async_ = false;
+    std::atomic<bool> writer_quit_{false};
+    std::thread writer_thread_;
+    std::mutex rings_mutex_;    // only taken when a thread registers its ring, and by the writer
+    std::vector<std::unique_ptr<LogRing>> rings_;
+    std::vector<std::unique_ptr<LogRing>> spare_rings_;  // drained rings of exited threads
+
     const char* levelToString(LogLevel level) {
         switch(level) {
             case LOG_DEBUG: return "DEBUG";
@@ -61,24 +139,170 @@ private:
         }
     }
 
-    std::string getCurrentTime() {
-        auto now = std::chrono::system_clock::now();
-        auto in_time_t = std::chrono::system_clock::to_time_t(now);
-        
-        std::stringstream ss;
-        ss << std::put_time(std::localtime(&in_time_t), "%Y-%m-%d %X");
-        return ss.str();
+    const char* getCurrentTime(time_t sec) {
+        if (sec != cached_sec_) {
+            struct tm tm_buf;
+            localtime_r(&sec, &tm_buf);
+            strftime(cached_time_, sizeof(cached_time_), "%Y-%m-%d %X", &tm_buf);
+            cached_sec_ = sec;
+        }
+        return cached_time_;
+    }
+
+    void format(std::string& out, int64_t time_us, LogLevel level, const char* text, size_t length) {
+        out += '[';
+        out += getCurrentTime(static_cast<time_t>(time_us / 1000000));
+        out += "] [";
+        out += levelToString(level);
+        out += "] ";
+        out.append(text, length);
+        out += '\n';
+    }
+
+    static void append(std::string& out, const char* text) { out += text; }
+    static void append(std::string& out, const std::string& text) { out += text; }
+    static void append(std::string& out, char c) { out += c; }
+
+    template <typename T>
+    static typename std::enable_if<std::is_integral<T>::value>::type append(std::string& out, T value) {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        out.append(digits, result.ptr - digits);
+    }
+
+    static void append(std::string& out, double value) {
+        char digits[32];
+        int n = snprintf(digits, sizeof(digits), "%.3f", value);
+        out.append(digits, n);
+    }
+
+    static int64_t wall_us() {
+        return duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+    }
+
+    LogRing* thread_ring() {
+        thread_local RingOwner owner;
+        if (!owner.ring) {
+            std::lock_guard<std::mutex> lock(rings_mutex_);
+            if (spare_rings_.empty()) {
+                rings_.emplace_back(new LogRing());
+            } else {
+                rings_.push_back(std::move(spare_rings_.back()));
+                spare_rings_.pop_back();
+            }
+            owner.ring = rings_.back().get();
+        }
+        return owner.ring;
+    }
+
+    void log_async(LogLevel level, const std::string& message) {
+        LogRing* ring = thread_ring();
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        if (tail - ring->head.load(std::memory_order_acquire) >= kRingRecords) {
+            ring->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        LogRecord& record = ring->records[tail % kRingRecords];
+        record.time_us = wall_us();
+        record.level = level;
+        record.length = std::min(message.size(), kRecordText);
+        memcpy(record.text, message.data(), record.length);
+        ring->tail.store(tail + 1, std::memory_order_release);
+    }
+
+    void write_batch(const std::string& out, const std::string& err) {
+        if (console_output_) {
+            if (!out.empty()) std::cout.write(out.data(), out.size()).flush();
+            if (!err.empty()) std::cerr.write(err.data(), err.size()).flush();
+        }
+        if (file_output_ && log_file_.is_open()) {
+            log_file_.write(out.data(), out.size());
+            log_file_.write(err.data(), err.size());
+            log_file_.flush();
+        }
+    }
+
+    // Drains every ring once, returns the number of records written
+    size_t drain_rings(std::vector<LogRecord>& batch, std::string& out, std::string& err) {
+        batch.clear();
+        uint64_t dropped = 0;
+        {
+            std::lock_guard<std::mutex> lock(rings_mutex_);
+            for (size_t i = 0; i < rings_.size();) {
+                LogRing* ring = rings_[i].get();
+                // Read before tail, so a retired ring's last records are included
+                bool retired = ring->retired.load(std::memory_order_acquire);
+                uint64_t head = ring->head.load(std::memory_order_relaxed);
+                uint64_t tail = ring->tail.load(std::memory_order_acquire);
+                for (; head != tail; head++) {
+                    batch.push_back(ring->records[head % kRingRecords]);
+                }
+                ring->head.store(head, std::memory_order_release);
+                dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+                if (!retired) {
+                    i++;
+                    continue;
+                }
+                if (spare_rings_.size() < kSpareRings) {
+                    ring->head.store(0, std::memory_order_relaxed);
+                    ring->tail.store(0, std::memory_order_relaxed);
+                    ring->retired.store(false, std::memory_order_relaxed);
+                    spare_rings_.push_back(std::move(rings_[i]));
+                }
+                rings_[i] = std::move(rings_.back());
+                rings_.pop_back();
+            }
+        }
+
+        // Records from different threads interleave, keep the output in time order
+        std::stable_sort(batch.begin(), batch.end(), [](const LogRecord& a, const LogRecord& b) {
+            return a.time_us < b.time_us;
+        });
+
+        out.clear();
+        err.clear();
+        for (const LogRecord& record : batch) {
+            format(record.level >= LOG_WARNING ? err : out, record.time_us, record.level, record.text, record.length);
+        }
+        if (dropped > 0) {
+            std::string note = "Logger dropped " + std::to_string(dropped) + " records, log rings full";
+            format(err, wall_us(), LOG_WARNING, note.data(), note.size());
+        }
+
+        write_batch(out, err);
+        return batch.size();
+    }
+
+    void writer_loop() {
+        std::vector<LogRecord> batch;
+        batch.reserve(kRingRecords);
+        std::string out, err;
+
+        while (!writer_quit_.load(std::memory_order_acquire)) {
+            if (drain_rings(batch, out, err) == 0) {
+                std::this_thread::sleep_for(20ms);
+            }
+        }
+        drain_rings(batch, out, err);
     }
 
 public:
     Logger() = default;
     ~Logger() {
+        if (writer_thread_.joinable()) {
+            writer_quit_ = true;
+            writer_thread_.join();
+        }
         if (log_file_.is_open()) {
             log_file_.close();
         }
     }
 
-    void init(const std::string& filename, LogLevel level = LOG_INFO, bool console = true) {
+    // Every pipeline calls this, only the first call configures the logger
+    void init(const std::string& filename, LogLevel level = LOG_INFO, bool console = true, bool async = false) {
+        if (initialized_) return;
+        initialized_ = true;
         min_level_ = level;
         console_output_ = console;
         
@@ -86,158 +310,3618 @@ public:
             log_file_.open(filename, std::ios::app);
             if (log_file_.is_open()) {
                 file_output_ = true;
-                log(LOG_INFO, "Logger initialized");
             } else {
                 std::cerr << "Failed to open log file: " << filename << std::endl;
             }
         }
+
+        if (async && !writer_thread_.joinable()) {
+            async_ = true;
+            writer_thread_ = std::thread(&Logger::writer_loop, this);
+        }
+
+        log(LOG_INFO, async_ ? "Logger initialized (async)" : "Logger initialized");
+    }
+
+    bool enabled(LogLevel level) const { return level >= min_level_; }
+
+    template <typename... Args>
+    void logf(LogLevel level, const Args&... args) {
+        thread_local std::string buffer;
+        buffer.clear();
+        (append(buffer, args), ...);
+        log(level, buffer);
     }
 
     void log(LogLevel level, const std::string& message) {
         if (level < min_level_) return;
 
+        if (async_) {
+            log_async(level, message);
+            return;
+        }
+
         std::lock_guard<std::mutex> lock(log_mutex_);
-        std::string formatted = "[" + getCurrentTime() + "] [" + levelToString(level) + "] " + message;
+        std::string formatted;
+        format(formatted, wall_us(), level, message.data(), message.size());
 
         if (console_output_) {
             if (level >= LOG_WARNING) {
-                std::cerr << formatted << std::endl;
+                std::cerr << formatted << std::flush;
             } else {
-                std::cout << formatted << std::endl;
+                std::cout << formatted << std::flush;
             }
         }
 
         if (file_output_ && log_file_.is_open()) {
-            log_file_ << formatted << std::endl;
+            log_file_ << formatted << std::flush;
         }
     }
 };
 
 Logger g_logger;
 
-// Parameters to be configured 
-struct Config {
-    std::string input_url;
-    std::string output_url;
-    bool enable_filter = false;
-    double input_fps = 18; // which is xpi rk3566 zero
-    int output_fps = 30;
-    std::string video_size = "1280x1024";
-    std::string log_file = "streamer.log";
-    LogLevel log_level = LOG_INFO;
-    bool console_log = true;
+// Compile-time floor for LOGF sites. Building with e.g.
+// -DSTREAMER_MIN_LOG_LEVEL=LOG_INFO removes every LOG_DEBUG statement.
+#ifndef STREAMER_MIN_LOG_LEVEL
+#define STREAMER_MIN_LOG_LEVEL LOG_DEBUG
+#endif
+
+// Level is checked before any argument is evaluated, so a disabled statement
+// costs one compare. Arguments are appended into a per-thread buffer instead
+// of building temporary std::strings.
+#define LOGF(level, ...) \
+    do { \
+        if ((level) >= STREAMER_MIN_LOG_LEVEL && g_logger.enabled(level)) { \
+            g_logger.logf((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+#ifdef STREAMER_COUNT_ALLOCS
+// Heap allocation counter for measuring per-frame allocations (make ALLOC_STATS=1)
+static std::atomic<uint64_t> g_heap_allocs{0};
+
+void* operator new(size_t size) {
+    g_heap_allocs.fetch_add(1, std::memory_order_relaxed);
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+// GCC pairs the inlined free() with the new-expression and flags it, although
+// both ends are ours
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+static uint64_t heap_allocs() { return g_heap_allocs.load(std::memory_order_relaxed); }
+#endif
+
+// Bounded single-producer/single-consumer frame ring between capture_loop and
+// encode_loop. Slots are allocated once in init(), push/pop never allocate.
+// The consumer spins briefly and then parks on a futex until a push or quit.
+// The producer may also take the oldest frame back (drop-oldest policies) or
+// park until the consumer frees a slot (blocking policy), so the head index
+// is advanced with CAS by both ends.
+class FrameRing {
+private:
+    static constexpr size_t kCacheLine = 64;
+    static constexpr int kSpinCount = 200;
+
+    // Spinning only helps when the other end can run meanwhile
+    int spin_count_ = std::thread::hardware_concurrency() > 1 ? kSpinCount : 0;
+
+    std::unique_ptr<std::atomic<AVFrame*>[]> slots_;
+    size_t mask_ = 0;
+
+    // Consumer side
+    alignas(kCacheLine) std::atomic<uint64_t> head_{0};
+    uint64_t tail_cache_ = 0;
+
+    // Producer side
+    alignas(kCacheLine) std::atomic<uint64_t> tail_{0};
+    uint64_t head_cache_ = 0;
+
+    // Futex words bumped on every push/pop/quit, and whether either end is parked on them
+    alignas(kCacheLine) std::atomic<uint32_t> data_seq_{0};
+    std::atomic<bool> consumer_parked_{false};
+    alignas(kCacheLine) std::atomic<uint32_t> space_seq_{0};
+    std::atomic<bool> producer_parked_{false};
+    std::atomic<bool> quit_{false};
+
+    static void futex_wait(std::atomic<uint32_t>* addr, uint32_t expected) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+    }
+
+    static void futex_wake(std::atomic<uint32_t>* addr) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+
+    static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        asm volatile("yield" ::: "memory");
+#endif
+    }
+
+    // Only the first notify after the other end parked pays for the wake;
+    // the parked end sets the flag again before it waits again
+    static void notify(std::atomic<uint32_t>& seq, std::atomic<bool>& parked) {
+        seq.fetch_add(1, std::memory_order_seq_cst);
+        if (parked.load(std::memory_order_seq_cst) && parked.exchange(false, std::memory_order_seq_cst)) {
+            futex_wake(&seq);
+        }
+    }
+
+    // Claims the slot at head against the other end, tail is a snapshot of tail_
+    AVFrame* claim_head(uint64_t tail) {
+        uint64_t head = head_.load(std::memory_order_acquire);
+        while (head < tail) {
+            AVFrame* frame = slots_[head & mask_].load(std::memory_order_acquire);
+            if (head_.compare_exchange_weak(head, head + 1, std::memory_order_acq_rel)) {
+                return frame;
+            }
+        }
+        return nullptr;
+    }
+
+    AVFrame* try_pop() {
+        uint64_t head = head_.load(std::memory_order_acquire);
+        if (head >= tail_cache_) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (head >= tail_cache_) return nullptr;
+        }
+        AVFrame* frame = claim_head(tail_cache_);
+        if (frame) notify(space_seq_, producer_parked_);
+        return frame;
+    }
+
+public:
+    ~FrameRing() { drain(); }
+
+    // Capacity is rounded up to a power of two
+    void init(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        slots_.reset(new std::atomic<AVFrame*>[size]);
+        for (size_t i = 0; i < size; i++) {
+            slots_[i].store(nullptr, std::memory_order_relaxed);
+        }
+        mask_ = size - 1;
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+
+    size_t size() const {
+        uint64_t head = head_.load(std::memory_order_acquire);
+        return tail_.load(std::memory_order_acquire) - head;
+    }
+
+    // Producer only. Returns false when the ring is full, the caller keeps the frame.
+    bool push(AVFrame* frame) {
+        uint64_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_cache_ > mask_) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail - head_cache_ > mask_) return false;
+        }
+        slots_[tail & mask_].store(frame, std::memory_order_release);
+        tail_.store(tail + 1, std::memory_order_release);
+        notify(data_seq_, consumer_parked_);
+        return true;
+    }
+
+    // Producer only. Parks until a slot frees up, returns false on quit.
+    bool push_blocking(AVFrame* frame) {
+        int spin = 0;
+        while (!push(frame)) {
+            if (quit_.load(std::memory_order_acquire)) return false;
+            if (spin++ < spin_count_) {
+                cpu_relax();
+                continue;
+            }
+            uint32_t seq = space_seq_.load(std::memory_order_seq_cst);
+            producer_parked_.store(true, std::memory_order_seq_cst);
+            if (size() > mask_ && !quit_.load(std::memory_order_acquire)) {
+                futex_wait(&space_seq_, seq);
+            }
+            producer_parked_.store(false, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // Producer only. Takes back the oldest queued frame, nullptr when empty.
+    AVFrame* steal_oldest() {
+        return claim_head(tail_.load(std::memory_order_relaxed));
+    }
+
+    // Consumer only. Blocks until a frame is available, returns nullptr on quit.
+    AVFrame* pop() {
+        for (int spin = 0; spin < spin_count_; spin++) {
+            if (quit_.load(std::memory_order_acquire)) return nullptr;
+            AVFrame* frame = try_pop();
+            if (frame) return frame;
+            cpu_relax();
+        }
+
+        while (true) {
+            uint32_t seq = data_seq_.load(std::memory_order_seq_cst);
+            consumer_parked_.store(true, std::memory_order_seq_cst);
+            if (quit_.load(std::memory_order_acquire)) {
+                consumer_parked_.store(false, std::memory_order_relaxed);
+                return nullptr;
+            }
+            AVFrame* frame = try_pop();
+            if (frame) {
+                consumer_parked_.store(false, std::memory_order_relaxed);
+                return frame;
+            }
+            futex_wait(&data_seq_, seq);
+            consumer_parked_.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    void wake_and_quit() {
+        quit_.store(true, std::memory_order_release);
+        data_seq_.fetch_add(1, std::memory_order_seq_cst);
+        space_seq_.fetch_add(1, std::memory_order_seq_cst);
+        futex_wake(&data_seq_);
+        futex_wake(&space_seq_);
+    }
+
+    // Frees whatever is left, only once both ends have stopped
+    void drain() {
+        if (!slots_) return;
+        AVFrame* frame;
+        while ((frame = steal_oldest()) != nullptr) {
+            av_frame_free(&frame);
+        }
+    }
 };
 
-class VideoStreamer {
+// Per-pipeline recycling of AVFrame shells, plus an AVBufferPool for frames
+// whose pixels we write ourselves. Frames cycle capture -> queue -> encoder ->
+// put() -> capture, so once the pipeline is primed nothing is allocated per
+// frame. get() and put() run on different threads; the free list is a
+// preallocated vector behind an uncontended mutex.
+class FramePool {
 public:
-    VideoStreamer(const Config& config) : config_(config) {
-        g_logger.init(config_.log_file, config_.log_level, config_.console_log);
+    ~FramePool() {
+        for (AVFrame* frame : free_) {
+            av_frame_free(&frame);
+        }
+        av_buffer_pool_uninit(&buffers_);
     }
-    ~VideoStreamer() { cleanup(); }
 
-    int init() {
-        g_logger.log(LOG_INFO, "Initializing video streamer...");
-        
-        while (!init_input()) {
-            if (should_stop_) return -1;
-            g_logger.log(LOG_WARNING, "Input initialization failed, retrying in 5 seconds...");
-            std::this_thread::sleep_for(5s); // Retry
+    // Preallocates count shells, and sizes the pixel buffers from the frame geometry
+    bool init(int width, int height, AVPixelFormat format, size_t count) {
+        width_ = width;
+        height_ = height;
+        format_ = format;
+        capacity_ = count;
+        free_.reserve(capacity_);
+        for (size_t i = 0; i < count; i++) {
+            AVFrame* frame = av_frame_alloc();
+            if (!frame) return false;
+            allocated_++;
+            free_.push_back(frame);
         }
 
-        if (config_.enable_filter) {
-            if (init_framerate_filter() < 0) return -1;
+        int size = av_image_get_buffer_size(format_, width_, height_, kAlign);
+        if (size < 0) return false;
+        buffers_ = av_buffer_pool_init(size, av_buffer_allocz);
+        return buffers_ != nullptr;
+    }
+
+    // An empty shell for av_frame_ref/av_frame_move_ref, nullptr only if allocation fails
+    AVFrame* get() {
+        handed_out_.fetch_add(1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (!free_.empty()) {
+                AVFrame* frame = free_.back();
+                free_.pop_back();
+                return frame;
+            }
         }
+        allocated_.fetch_add(1, std::memory_order_relaxed);
+        return av_frame_alloc();
+    }
 
-        if (init_encoder() < 0) return -1;
+    // A writable frame of the pool geometry, its pixels come from the buffer pool
+    AVFrame* get_buffered() {
+        AVFrame* frame = get();
+        if (!frame) return nullptr;
+        frame->buf[0] = av_buffer_pool_get(buffers_);
+        if (!frame->buf[0]) {
+            put(frame);
+            return nullptr;
+        }
+        frame->width = width_;
+        frame->height = height_;
+        frame->format = format_;
+        av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data,
+                             format_, width_, height_, kAlign);
+        return frame;
+    }
 
-        while (!init_output()) {
-            if (should_stop_) return -1;
-            g_logger.log(LOG_WARNING, "Output initialization failed, retrying in 5 seconds...");
-            std::this_thread::sleep_for(5s); // Retry
+    // Drops the frame's references (V4L2 buffers go back to the driver here)
+    // and recycles the shell
+    void put(AVFrame* frame) {
+        if (!frame) return;
+        av_frame_unref(frame);
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (free_.size() < capacity_) {
+                free_.push_back(frame);
+                return;
+            }
         }
+        // More shells than the pool was sized for are in flight, don't grow the free list
+        av_frame_free(&frame);
+    }
 
-        g_logger.log(LOG_INFO, "Video streamer initialized successfully");
-        return 0;
+    uint64_t allocated() const { return allocated_.load(std::memory_order_relaxed); }
+    uint64_t handed_out() const { return handed_out_.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr int kAlign = 32;
+
+    std::mutex mtx_;
+    std::vector<AVFrame*> free_;
+    size_t capacity_ = 0;
+    AVBufferPool* buffers_ = nullptr;
+    int width_ = 0;
+    int height_ = 0;
+    AVPixelFormat format_ = AV_PIX_FMT_NONE;
+    std::atomic<uint64_t> allocated_{0};
+    std::atomic<uint64_t> handed_out_{0};
+};
+
+// Converts the capture rate to the output rate from frame timestamps. Each
+// input frame lands in the output slot (1/out_fps) nearest its timestamp and
+// goes out right away; slots it skipped are filled with new references to
+// the previous frame, so up-conversion copies no pixels and adds no latency.
+// Two frames landing in the same slot means down-conversion, the later one
+// is dropped.
+class FrameRateConverter {
+public:
+    ~FrameRateConverter() { av_frame_free(&last_); }
+
+    bool init(AVRational in_time_base, int out_fps) {
+        in_time_base_ = in_time_base;
+        out_time_base_ = {1, out_fps};
+        max_gap_ = out_fps;  // after a stall longer than a second, skip ahead instead of flooding the encoder
+        last_ = av_frame_alloc();
+        return last_ != nullptr;
+    }
+
+    // Takes the frame's references. emit(frame, pts) is called for each output
+    // slot in order with pts in 1/out_fps; it borrows the frame and has to
+    // take its own reference.
+    template <typename Emit>
+    void push(AVFrame* frame, Emit&& emit) {
+        if (frame->pts == AV_NOPTS_VALUE) {
+            av_frame_unref(frame);
+            return;
+        }
+        if (origin_ == AV_NOPTS_VALUE) origin_ = frame->pts;
+        int64_t slot = av_rescale_q_rnd(frame->pts - origin_, in_time_base_, out_time_base_, AV_ROUND_NEAR_INF);
+        if (slot < next_slot_) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            av_frame_unref(frame);
+            return;
+        }
+
+        if (last_->buf[0] && slot - next_slot_ <= max_gap_) {
+            for (; next_slot_ < slot; next_slot_++) {
+                emit(last_, next_slot_);
+                duplicated_.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        av_frame_unref(last_);
+        av_frame_move_ref(last_, frame);
+        emit(last_, slot);
+        next_slot_ = slot + 1;
+    }
+
+    // Lets go of the held frame, a V4L2 buffer stays loaned while it is here
+    void reset() {
+        if (last_) av_frame_unref(last_);
     }
 
-    void run() {
-        g_logger.log(LOG_INFO, "Starting video streamer threads...");
-        std::thread capture_thread(&VideoStreamer::capture_loop, this);
-        std::thread encode_thread(&VideoStreamer::encode_loop, this);
+    uint64_t duplicated() const { return duplicated_.load(std::memory_order_relaxed); }
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
 
-        capture_thread.join();
-        encode_thread.join();
-        
-        g_logger.log(LOG_INFO, "Video streamer threads stopped");
+private:
+    AVRational in_time_base_ = {1, 1};
+    AVRational out_time_base_ = {1, 1};
+    int64_t max_gap_ = 0;
+    int64_t origin_ = AV_NOPTS_VALUE;
+    int64_t next_slot_ = 0;
+    AVFrame* last_ = nullptr;
+    std::atomic<uint64_t> duplicated_{0};
+    std::atomic<uint64_t> dropped_{0};
+};
+
+// Horizontal mirror kernels for NV12 and YUV420P. A row is reversed in units
+// of 1 byte (Y, and U/V of YUV420P) or 2 bytes (the interleaved UV plane of
+// NV12). The SIMD loops load a vector from the end of the source row, reverse
+// it in registers and store it at the start of the destination row, so the
+// mirror costs one pass over the picture, the same as a plain copy.
+typedef void (*MirrorRowFn)(uint8_t* dst, const uint8_t* src, int units);
+
+template <int kUnit>
+static void mirror_row_scalar(uint8_t* dst, const uint8_t* src, int units) {
+    for (int i = 0; i < units; i++) {
+        memcpy(dst + i * kUnit, src + (units - 1 - i) * kUnit, kUnit);
+    }
+}
+
+#if defined(__SSE2__)
+template <int kUnit>
+static inline __m128i reverse_sse2(__m128i v) {
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    if (kUnit == 1) {
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    }
+    return v;
+}
+
+template <int kUnit>
+static void mirror_row_sse2(uint8_t* dst, const uint8_t* src, int units) {
+    int bytes = units * kUnit;
+    int x = 0;
+    for (; x + 16 <= bytes; x += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + bytes - x - 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), reverse_sse2<kUnit>(v));
+    }
+    mirror_row_scalar<kUnit>(dst + x, src, (bytes - x) / kUnit);
+}
+
+template <int kUnit>
+__attribute__((target("avx2")))
+static void mirror_row_avx2(uint8_t* dst, const uint8_t* src, int units) {
+    // Reverses within each 128-bit lane, the lane swap finishes the job
+    const __m256i mask = kUnit == 1 ?
+        _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                         15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0) :
+        _mm256_setr_epi8(14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1,
+                         14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+    int bytes = units * kUnit;
+    int x = 0;
+    for (; x + 32 <= bytes; x += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + bytes - x - 32));
+        v = _mm256_shuffle_epi8(v, mask);
+        v = _mm256_permute2x128_si256(v, v, 0x01);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x), v);
+    }
+    mirror_row_sse2<kUnit>(dst + x, src, (bytes - x) / kUnit);
+}
+#elif defined(__ARM_NEON)
+template <int kUnit>
+static void mirror_row_neon(uint8_t* dst, const uint8_t* src, int units) {
+    int bytes = units * kUnit;
+    int x = 0;
+    for (; x + 16 <= bytes; x += 16) {
+        uint8x16_t v = vld1q_u8(src + bytes - x - 16);
+        v = kUnit == 1 ? vrev64q_u8(v) : vreinterpretq_u8_u16(vrev64q_u16(vreinterpretq_u16_u8(v)));
+        vst1q_u8(dst + x, vcombine_u8(vget_high_u8(v), vget_low_u8(v)));
+    }
+    mirror_row_scalar<kUnit>(dst + x, src, (bytes - x) / kUnit);
+}
+#endif
+
+struct MirrorKernels {
+    MirrorRowFn bytes;
+    MirrorRowFn pairs;
+    const char* name;
+};
+
+static MirrorKernels select_mirror_kernels() {
+#if defined(__SSE2__)
+    if (__builtin_cpu_supports("avx2")) {
+        return {mirror_row_avx2<1>, mirror_row_avx2<2>, "avx2"};
+    }
+    return {mirror_row_sse2<1>, mirror_row_sse2<2>, "sse2"};
+#elif defined(__ARM_NEON)
+    return {mirror_row_neon<1>, mirror_row_neon<2>, "neon"};
+#else
+    return {mirror_row_scalar<1>, mirror_row_scalar<2>, "scalar"};
+#endif
+}
+
+static const MirrorKernels& mirror_kernels() {
+    static const MirrorKernels kernels = select_mirror_kernels();
+    return kernels;
+}
+
+static void mirror_plane(MirrorRowFn row, uint8_t* dst, ptrdiff_t dst_stride,
+                         const uint8_t* src, ptrdiff_t src_stride, int units, int rows) {
+    for (int y = 0; y < rows; y++) {
+        row(dst + y * dst_stride, src + y * src_stride, units);
+    }
+}
+
+static void copy_plane(uint8_t* dst, ptrdiff_t dst_stride,
+                       const uint8_t* src, ptrdiff_t src_stride, int bytes, int rows) {
+    for (int y = 0; y < rows; y++) {
+        memcpy(dst + y * dst_stride, src + y * src_stride, bytes);
+    }
+}
+
+// 8x8 block transposes, in registers where we have SIMD. Elements are 1
+// byte (Y, U, V) or 2 bytes (NV12 UV pairs). dst row i receives src column i.
+template <int kUnit>
+static inline void transpose8x8_scalar(uint8_t* dst, ptrdiff_t dst_stride,
+                                       const uint8_t* src, ptrdiff_t src_stride, int cols, int rows) {
+    for (int y = 0; y < rows; y++) {
+        for (int x = 0; x < cols; x++) {
+            memcpy(dst + x * dst_stride + y * kUnit, src + y * src_stride + x * kUnit, kUnit);
+        }
+    }
+}
+
+#if defined(__SSE2__)
+static inline void transpose8x8_u8(uint8_t* dst, ptrdiff_t ds, const uint8_t* src, ptrdiff_t ss) {
+    __m128i r0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src));
+    __m128i r1 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + ss));
+    __m128i r2 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + 2 * ss));
+    __m128i r3 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + 3 * ss));
+    __m128i r4 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + 4 * ss));
+    __m128i r5 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + 5 * ss));
+    __m128i r6 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + 6 * ss));
+    __m128i r7 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + 7 * ss));
+    __m128i a0 = _mm_unpacklo_epi8(r0, r1);
+    __m128i a1 = _mm_unpacklo_epi8(r2, r3);
+    __m128i a2 = _mm_unpacklo_epi8(r4, r5);
+    __m128i a3 = _mm_unpacklo_epi8(r6, r7);
+    __m128i b0 = _mm_unpacklo_epi16(a0, a1);
+    __m128i b1 = _mm_unpackhi_epi16(a0, a1);
+    __m128i b2 = _mm_unpacklo_epi16(a2, a3);
+    __m128i b3 = _mm_unpackhi_epi16(a2, a3);
+    __m128i c0 = _mm_unpacklo_epi32(b0, b2);  // columns 0, 1
+    __m128i c1 = _mm_unpackhi_epi32(b0, b2);  // columns 2, 3
+    __m128i c2 = _mm_unpacklo_epi32(b1, b3);  // columns 4, 5
+    __m128i c3 = _mm_unpackhi_epi32(b1, b3);  // columns 6, 7
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), c0);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + ds), _mm_srli_si128(c0, 8));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 2 * ds), c1);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 3 * ds), _mm_srli_si128(c1, 8));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 4 * ds), c2);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 5 * ds), _mm_srli_si128(c2, 8));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 6 * ds), c3);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 7 * ds), _mm_srli_si128(c3, 8));
+}
+
+static inline void transpose8x8_u16(uint8_t* dst, ptrdiff_t ds, const uint8_t* src, ptrdiff_t ss) {
+    __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    __m128i r1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + ss));
+    __m128i r2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * ss));
+    __m128i r3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * ss));
+    __m128i r4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * ss));
+    __m128i r5 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 5 * ss));
+    __m128i r6 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 6 * ss));
+    __m128i r7 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 7 * ss));
+    __m128i a0 = _mm_unpacklo_epi16(r0, r1);
+    __m128i a1 = _mm_unpackhi_epi16(r0, r1);
+    __m128i a2 = _mm_unpacklo_epi16(r2, r3);
+    __m128i a3 = _mm_unpackhi_epi16(r2, r3);
+    __m128i a4 = _mm_unpacklo_epi16(r4, r5);
+    __m128i a5 = _mm_unpackhi_epi16(r4, r5);
+    __m128i a6 = _mm_unpacklo_epi16(r6, r7);
+    __m128i a7 = _mm_unpackhi_epi16(r6, r7);
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+    __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+    __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+    __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+    __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_unpacklo_epi64(b0, b4));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + ds), _mm_unpackhi_epi64(b0, b4));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 2 * ds), _mm_unpacklo_epi64(b1, b5));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * ds), _mm_unpackhi_epi64(b1, b5));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4 * ds), _mm_unpacklo_epi64(b2, b6));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 5 * ds), _mm_unpackhi_epi64(b2, b6));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 6 * ds), _mm_unpacklo_epi64(b3, b7));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 7 * ds), _mm_unpackhi_epi64(b3, b7));
+}
+#elif defined(__ARM_NEON)
+static inline void transpose8x8_u8(uint8_t* dst, ptrdiff_t ds, const uint8_t* src, ptrdiff_t ss) {
+    uint8x8x2_t t0 = vtrn_u8(vld1_u8(src), vld1_u8(src + ss));
+    uint8x8x2_t t1 = vtrn_u8(vld1_u8(src + 2 * ss), vld1_u8(src + 3 * ss));
+    uint8x8x2_t t2 = vtrn_u8(vld1_u8(src + 4 * ss), vld1_u8(src + 5 * ss));
+    uint8x8x2_t t3 = vtrn_u8(vld1_u8(src + 6 * ss), vld1_u8(src + 7 * ss));
+    uint16x4x2_t u0 = vtrn_u16(vreinterpret_u16_u8(t0.val[0]), vreinterpret_u16_u8(t1.val[0]));
+    uint16x4x2_t u1 = vtrn_u16(vreinterpret_u16_u8(t0.val[1]), vreinterpret_u16_u8(t1.val[1]));
+    uint16x4x2_t u2 = vtrn_u16(vreinterpret_u16_u8(t2.val[0]), vreinterpret_u16_u8(t3.val[0]));
+    uint16x4x2_t u3 = vtrn_u16(vreinterpret_u16_u8(t2.val[1]), vreinterpret_u16_u8(t3.val[1]));
+    uint32x2x2_t v0 = vtrn_u32(vreinterpret_u32_u16(u0.val[0]), vreinterpret_u32_u16(u2.val[0]));  // columns 0, 4
+    uint32x2x2_t v1 = vtrn_u32(vreinterpret_u32_u16(u1.val[0]), vreinterpret_u32_u16(u3.val[0]));  // columns 1, 5
+    uint32x2x2_t v2 = vtrn_u32(vreinterpret_u32_u16(u0.val[1]), vreinterpret_u32_u16(u2.val[1]));  // columns 2, 6
+    uint32x2x2_t v3 = vtrn_u32(vreinterpret_u32_u16(u1.val[1]), vreinterpret_u32_u16(u3.val[1]));  // columns 3, 7
+    vst1_u8(dst, vreinterpret_u8_u32(v0.val[0]));
+    vst1_u8(dst + ds, vreinterpret_u8_u32(v1.val[0]));
+    vst1_u8(dst + 2 * ds, vreinterpret_u8_u32(v2.val[0]));
+    vst1_u8(dst + 3 * ds, vreinterpret_u8_u32(v3.val[0]));
+    vst1_u8(dst + 4 * ds, vreinterpret_u8_u32(v0.val[1]));
+    vst1_u8(dst + 5 * ds, vreinterpret_u8_u32(v1.val[1]));
+    vst1_u8(dst + 6 * ds, vreinterpret_u8_u32(v2.val[1]));
+    vst1_u8(dst + 7 * ds, vreinterpret_u8_u32(v3.val[1]));
+}
+
+static inline void transpose8x8_u16(uint8_t* dst, ptrdiff_t ds, const uint8_t* src, ptrdiff_t ss) {
+    const uint16_t* s = reinterpret_cast<const uint16_t*>(src);
+    ptrdiff_t sw = ss / 2;
+    uint16x8x2_t t0 = vtrnq_u16(vld1q_u16(s), vld1q_u16(s + sw));
+    uint16x8x2_t t1 = vtrnq_u16(vld1q_u16(s + 2 * sw), vld1q_u16(s + 3 * sw));
+    uint16x8x2_t t2 = vtrnq_u16(vld1q_u16(s + 4 * sw), vld1q_u16(s + 5 * sw));
+    uint16x8x2_t t3 = vtrnq_u16(vld1q_u16(s + 6 * sw), vld1q_u16(s + 7 * sw));
+    uint32x4x2_t u0 = vtrnq_u32(vreinterpretq_u32_u16(t0.val[0]), vreinterpretq_u32_u16(t1.val[0]));  // columns 0/4, 2/6
+    uint32x4x2_t u1 = vtrnq_u32(vreinterpretq_u32_u16(t0.val[1]), vreinterpretq_u32_u16(t1.val[1]));  // columns 1/5, 3/7
+    uint32x4x2_t u2 = vtrnq_u32(vreinterpretq_u32_u16(t2.val[0]), vreinterpretq_u32_u16(t3.val[0]));
+    uint32x4x2_t u3 = vtrnq_u32(vreinterpretq_u32_u16(t2.val[1]), vreinterpretq_u32_u16(t3.val[1]));
+    uint16x8_t c0 = vreinterpretq_u16_u32(u0.val[0]), c2 = vreinterpretq_u16_u32(u0.val[1]);
+    uint16x8_t c1 = vreinterpretq_u16_u32(u1.val[0]), c3 = vreinterpretq_u16_u32(u1.val[1]);
+    uint16x8_t d0 = vreinterpretq_u16_u32(u2.val[0]), d2 = vreinterpretq_u16_u32(u2.val[1]);
+    uint16x8_t d1 = vreinterpretq_u16_u32(u3.val[0]), d3 = vreinterpretq_u16_u32(u3.val[1]);
+    uint16_t* d = reinterpret_cast<uint16_t*>(dst);
+    ptrdiff_t dw = ds / 2;
+    vst1q_u16(d, vcombine_u16(vget_low_u16(c0), vget_low_u16(d0)));
+    vst1q_u16(d + dw, vcombine_u16(vget_low_u16(c1), vget_low_u16(d1)));
+    vst1q_u16(d + 2 * dw, vcombine_u16(vget_low_u16(c2), vget_low_u16(d2)));
+    vst1q_u16(d + 3 * dw, vcombine_u16(vget_low_u16(c3), vget_low_u16(d3)));
+    vst1q_u16(d + 4 * dw, vcombine_u16(vget_high_u16(c0), vget_high_u16(d0)));
+    vst1q_u16(d + 5 * dw, vcombine_u16(vget_high_u16(c1), vget_high_u16(d1)));
+    vst1q_u16(d + 6 * dw, vcombine_u16(vget_high_u16(c2), vget_high_u16(d2)));
+    vst1q_u16(d + 7 * dw, vcombine_u16(vget_high_u16(c3), vget_high_u16(d3)));
+}
+#else
+static inline void transpose8x8_u8(uint8_t* dst, ptrdiff_t ds, const uint8_t* src, ptrdiff_t ss) {
+    transpose8x8_scalar<1>(dst, ds, src, ss, 8, 8);
+}
+
+static inline void transpose8x8_u16(uint8_t* dst, ptrdiff_t ds, const uint8_t* src, ptrdiff_t ss) {
+    transpose8x8_scalar<2>(dst, ds, src, ss, 8, 8);
+}
+#endif
+
+// dst row x receives src column x. Walks the plane in 64x64 tiles so the rows
+// being read and the rows being written both stay in L1 (32KB on a Cortex-A55)
+// instead of every column of a 1280-wide plane evicting the last.
+template <int kUnit>
+static void transpose_plane(uint8_t* dst, ptrdiff_t dst_stride,
+                            const uint8_t* src, ptrdiff_t src_stride, int width, int height) {
+    static constexpr int kTile = 64;
+    for (int ty = 0; ty < height; ty += kTile) {
+        int y_end = std::min(ty + kTile, height);
+        for (int tx = 0; tx < width; tx += kTile) {
+            int x_end = std::min(tx + kTile, width);
+            for (int y = ty; y < y_end; y += 8) {
+                for (int x = tx; x < x_end; x += 8) {
+                    uint8_t* d = dst + x * dst_stride + y * kUnit;
+                    const uint8_t* s = src + y * src_stride + x * kUnit;
+                    if (y + 8 <= y_end && x + 8 <= x_end) {
+                        if (kUnit == 1) transpose8x8_u8(d, dst_stride, s, src_stride);
+                        else transpose8x8_u16(d, dst_stride, s, src_stride);
+                    } else {
+                        transpose8x8_scalar<kUnit>(d, dst_stride, s, src_stride,
+                                                   std::min(8, x_end - x), std::min(8, y_end - y));
+                    }
+                }
+            }
+        }
+    }
+}
+
+// One plane of a clockwise rotation followed by an optional mirror. The
+// 90-degree family is a transpose with the source and/or destination walked
+// bottom-up; the 180 family is the mirror kernel or a row copy, bottom-up.
+template <int kUnit>
+static void transform_plane(MirrorRowFn mirror_row, uint8_t* dst, ptrdiff_t dst_stride,
+                            const uint8_t* src, ptrdiff_t src_stride, int width, int height,
+                            int rotation, bool mirror) {
+    const uint8_t* src_last = src + (height - 1) * src_stride;
+    uint8_t* dst_last = dst + (width - 1) * dst_stride;  // rotated planes have width rows
+    switch (rotation) {
+        case 90:
+            if (mirror) transpose_plane<kUnit>(dst, dst_stride, src, src_stride, width, height);
+            else transpose_plane<kUnit>(dst, dst_stride, src_last, -src_stride, width, height);
+            break;
+        case 180:
+            if (mirror) copy_plane(dst, dst_stride, src_last, -src_stride, width * kUnit, height);
+            else mirror_plane(mirror_row, dst, dst_stride, src_last, -src_stride, width, height);
+            break;
+        case 270:
+            if (mirror) transpose_plane<kUnit>(dst_last, -dst_stride, src_last, -src_stride, width, height);
+            else transpose_plane<kUnit>(dst_last, -dst_stride, src, src_stride, width, height);
+            break;
+        default:
+            if (mirror) mirror_plane(mirror_row, dst, dst_stride, src, src_stride, width, height);
+            else copy_plane(dst, dst_stride, src, src_stride, width * kUnit, height);
+            break;
     }
+}
+
+// Writes src rotated clockwise by rotation degrees, then mirrored if asked,
+// into dst. width/height are the source's. False for formats it doesn't handle.
+static bool transform_picture(uint8_t* const dst[4], const int dst_linesize[4],
+                              uint8_t* const src[4], const int src_linesize[4],
+                              AVPixelFormat format, int width, int height, int rotation, bool mirror) {
+    const MirrorKernels& k = mirror_kernels();
+    int chroma_width = (width + 1) / 2;
+    int chroma_height = (height + 1) / 2;
+    switch (format) {
+        case AV_PIX_FMT_NV12:
+            transform_plane<1>(k.bytes, dst[0], dst_linesize[0], src[0], src_linesize[0],
+                               width, height, rotation, mirror);
+            transform_plane<2>(k.pairs, dst[1], dst_linesize[1], src[1], src_linesize[1],
+                               chroma_width, chroma_height, rotation, mirror);
+            return true;
+        case AV_PIX_FMT_YUV420P:
+            for (int p = 0; p < 3; p++) {
+                transform_plane<1>(k.bytes, dst[p], dst_linesize[p], src[p], src_linesize[p],
+                                   p ? chroma_width : width, p ? chroma_height : height, rotation, mirror);
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Lock-free latency histogram with HDR-style log-linear buckets: exact below
+// 64us, then 32 sub-buckets per power of two (about 3% relative error) up to
+// roughly a minute. record() is a few relaxed atomic adds so the pipeline
+// threads can call it per frame, percentiles are computed on demand.
+class LatencyHistogram {
+private:
+    static constexpr int kSubBits = 5;
+    static constexpr uint64_t kSubCount = 1 << kSubBits;
+    static constexpr int kMaxShift = 21;
+    static constexpr size_t kBuckets = (kMaxShift + 2) * kSubCount;
+
+    std::atomic<uint64_t> buckets_[kBuckets] = {};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_us_{0};
+    std::atomic<uint64_t> max_us_{0};
+
+    static size_t bucket_index(uint64_t us) {
+        if (us < 2 * kSubCount) return us;
+        int shift = (63 - __builtin_clzll(us)) - kSubBits;
+        if (shift > kMaxShift) return kBuckets - 1;
+        return (shift + 1) * kSubCount + ((us >> shift) - kSubCount);
+    }
+
+    // Upper bound of the values that land in a bucket
+    static uint64_t bucket_value(size_t index) {
+        if (index < 2 * kSubCount) return index;
+        int shift = index / kSubCount - 1;
+        uint64_t sub = index % kSubCount + kSubCount;
+        return ((sub + 1) << shift) - 1;
+    }
+
+public:
+    void record(int64_t us) {
+        if (us < 0) us = 0;
+        buckets_[bucket_index(us)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_us_.fetch_add(us, std::memory_order_relaxed);
+
+        uint64_t prev = max_us_.load(std::memory_order_relaxed);
+        while (static_cast<uint64_t>(us) > prev &&
+               !max_us_.compare_exchange_weak(prev, us, std::memory_order_relaxed)) {
+        }
+    }
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+
+    // q in [0, 1], e.g. 0.999 for p999
+    uint64_t percentile(double q) const {
+        uint64_t total = count();
+        if (total == 0) return 0;
+
+        uint64_t rank = static_cast<uint64_t>(q * total);
+        if (rank >= total) rank = total - 1;
+
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; i++) {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if (seen > rank) {
+                return std::min(bucket_value(i), max_us_.load(std::memory_order_relaxed));
+            }
+        }
+        return max_us_.load(std::memory_order_relaxed);
+    }
+
+    std::string summary() const {
+        uint64_t n = count();
+        uint64_t mean = n ? sum_us_.load(std::memory_order_relaxed) / n : 0;
+        return "n=" + std::to_string(n) +
+               " mean=" + std::to_string(mean) + "us" +
+               " p50=" + std::to_string(percentile(0.50)) + "us" +
+               " p99=" + std::to_string(percentile(0.99)) + "us" +
+               " p999=" + std::to_string(percentile(0.999)) + "us" +
+               " max=" + std::to_string(max_us_.load(std::memory_order_relaxed)) + "us";
+    }
+};
+
+static int64_t now_us() {
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Set from SIGUSR1, main dumps the pipeline stats when it sees it
+static std::atomic<bool> g_dump_stats{false};
+
+static std::vector<std::string> split_list(const std::string& list, char delimiter) {
+    std::vector<std::string> items;
+    size_t begin = 0;
+    while (true) {
+        size_t end = list.find(delimiter, begin);
+        items.push_back(list.substr(begin, end - begin));
+        if (end == std::string::npos) break;
+        begin = end + 1;
+    }
+    return items;
+}
+
+// Where a pipeline thread may run and how the kernel schedules it. Policy
+// SCHED_FIFO or SCHED_RR with priority 1-99, or SCHED_OTHER with a nice level.
+struct ThreadPlacement {
+    std::vector<int> cpus;     // empty: wherever the scheduler likes
+    int policy = SCHED_OTHER;
+    int priority = 0;
+    int nice = 0;
+};
+
+// Applies the configured placement to each pipeline thread by role
+// (capture, process, encode, output) as the thread starts, and keeps a list
+// of live threads so their scheduling can be reported. Scheduling latency
+// comes from the kernel's schedstat: how long each thread sat runnable on a
+// run queue before it got a CPU, plus how often it was preempted.
+class ThreadPlacer {
+public:
+    static constexpr const char* kRoles[] = {"capture", "process", "encode", "output"};
+
+    // Before any pipeline thread starts
+    void configure(const std::map<std::string, ThreadPlacement>& placements, bool memory_locked) {
+        placements_ = placements;
+        memory_locked_ = memory_locked;
+    }
+
+    // Called by a thread on itself, first thing. Failures are logged and the
+    // thread runs on with the default scheduling.
+    void enter(const std::string& role, const std::string& label) {
+        pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+        pthread_setname_np(pthread_self(), role.substr(0, 15).c_str());
+        if (memory_locked_) prefault_stack();
+
+        std::string applied;
+        auto it = placements_.find(role);
+        if (it != placements_.end()) applied = apply(it->second, tid, role);
+
+        std::lock_guard<std::mutex> lock(mtx_);
+        Entry entry;
+        entry.role = role;
+        entry.label = label;
+        entry.tid = tid;
+        entry.placement = applied.empty() ? "default" : applied;
+        read_sched(tid, entry.last);
+        threads_.push_back(entry);
+    }
+
+    void leave() {
+        pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+        std::lock_guard<std::mutex> lock(mtx_);
+        threads_.erase(std::remove_if(threads_.begin(), threads_.end(),
+                                      [tid](const Entry& entry) { return entry.tid == tid; }),
+                       threads_.end());
+    }
+
+    // One line per live thread, for the interval since the previous dump:
+    // CPU share, mean run queue wait per time slice, involuntary switches
+    void dump_stats() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (Entry& entry : threads_) {
+            Sched now;
+            if (!read_sched(entry.tid, now)) continue;
+            uint64_t run_ns = now.run_ns - entry.last.run_ns;
+            uint64_t wait_ns = now.wait_ns - entry.last.wait_ns;
+            uint64_t slices = now.slices - entry.last.slices;
+            uint64_t preempted = now.involuntary - entry.last.involuntary;
+            int64_t wall_us = now.at_us - entry.last.at_us;
+            entry.last = now;
+
+            std::ostringstream line;
+            line << std::fixed << std::setprecision(1)
+                 << "Thread " << entry.role << " " << entry.label << " tid=" << entry.tid
+                 << " [" << entry.placement << "] cpu=" << (wall_us > 0 ? run_ns / 10.0 / wall_us : 0.0) << "%"
+                 << " runq_wait=" << (slices ? wait_ns / 1000.0 / slices : 0.0) << "us/slice"
+                 << " runq_total=" << wait_ns / 1000 << "us"
+                 << " slices=" << slices
+                 << " preempted=" << preempted;
+            g_logger.log(LOG_INFO, line.str());
+        }
+    }
+
+    // Locks what is mapped now (frame pools, V4L2 buffers, the encoder) and
+    // what gets touched later. Later mappings lock page by page as they fault
+    // in, so idle 8 MB thread stacks don't pin memory; a heap reserve and each
+    // thread's working stack are faulted in up front instead.
+    static bool lock_memory() {
+        if (mlockall(MCL_CURRENT) < 0) {
+            g_logger.log(LOG_WARNING, std::string("mlockall failed (needs CAP_IPC_LOCK or RLIMIT_MEMLOCK): ") + strerror(errno));
+            return false;
+        }
+        int future = MCL_CURRENT | MCL_FUTURE;
+#ifdef MCL_ONFAULT
+        future |= MCL_ONFAULT;
+#endif
+        if (mlockall(future) < 0) {
+            g_logger.log(LOG_WARNING, std::string("mlockall(MCL_FUTURE) failed: ") + strerror(errno));
+            return false;
+        }
+        // Freed heap stays mapped, and large blocks come from the locked heap, not fresh mmaps
+        mallopt(M_TRIM_THRESHOLD, -1);
+        mallopt(M_MMAP_MAX, 0);
+        if (char* reserve = static_cast<char*>(malloc(kHeapReserve))) {
+            for (size_t i = 0; i < kHeapReserve; i += kPageSize) reserve[i] = 0;
+            free(reserve);
+        }
+        g_logger.log(LOG_INFO, "Memory locked, heap reserve " + std::to_string(kHeapReserve >> 20) + " MB");
+        return true;
+    }
+
+private:
+    struct Sched {
+        uint64_t run_ns = 0;
+        uint64_t wait_ns = 0;
+        uint64_t slices = 0;
+        uint64_t involuntary = 0;
+        int64_t at_us = 0;
+    };
+
+    struct Entry {
+        std::string role;
+        std::string label;
+        pid_t tid = 0;
+        std::string placement;
+        Sched last;
+    };
+
+    static constexpr size_t kPageSize = 4096;
+    static constexpr size_t kStackPrefault = 256 * 1024;
+    static constexpr size_t kHeapReserve = 16 * 1024 * 1024;
+
+    std::map<std::string, ThreadPlacement> placements_;
+    bool memory_locked_ = false;
+    std::mutex mtx_;
+    std::vector<Entry> threads_;
+
+    // Returns what took effect, e.g. "cpus=2-3 fifo:50"
+    static std::string apply(const ThreadPlacement& placement, pid_t tid, const std::string& role) {
+        std::string applied;
+        if (!placement.cpus.empty()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int cpu : placement.cpus) CPU_SET(cpu, &set);
+            int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            if (ret == 0) {
+                applied += "cpus=" + cpu_list(placement.cpus);
+            } else {
+                g_logger.log(LOG_WARNING, "Failed to pin " + role + " thread: " + strerror(ret));
+            }
+        }
+        if (placement.policy == SCHED_FIFO || placement.policy == SCHED_RR) {
+            sched_param param = {};
+            param.sched_priority = placement.priority;
+            int ret = pthread_setschedparam(pthread_self(), placement.policy, &param);
+            if (ret == 0) {
+                applied += std::string(applied.empty() ? "" : " ") + (placement.policy == SCHED_FIFO ? "fifo:" : "rr:") +
+                           std::to_string(placement.priority);
+            } else {
+                g_logger.log(LOG_WARNING, "Failed to set real-time priority for " + role +
+                             " thread (needs CAP_SYS_NICE or RLIMIT_RTPRIO): " + strerror(ret));
+            }
+        } else if (placement.nice) {
+            // On Linux the nice value is per thread
+            if (setpriority(PRIO_PROCESS, tid, placement.nice) == 0) {
+                applied += std::string(applied.empty() ? "" : " ") + "nice:" + std::to_string(placement.nice);
+            } else {
+                g_logger.log(LOG_WARNING, "Failed to set nice level for " + role + " thread: " + strerror(errno));
+            }
+        }
+        return applied;
+    }
+
+    static std::string cpu_list(const std::vector<int>& cpus) {
+        std::string list;
+        for (int cpu : cpus) list += (list.empty() ? "" : ",") + std::to_string(cpu);
+        return list;
+    }
+
+    // Touches the stack this thread is going to use, so the first deep call
+    // (the encoder) doesn't take page faults with the memory locked
+    __attribute__((noinline)) static void prefault_stack() {
+        volatile uint8_t stack[kStackPrefault];
+        for (size_t i = 0; i < sizeof(stack); i += kPageSize) stack[i] = 0;
+    }
+
+    // /proc/self/task/TID/schedstat: ns on CPU, ns waiting on a run queue, time slices
+    static bool read_sched(pid_t tid, Sched& out) {
+        std::string task = "/proc/self/task/" + std::to_string(tid);
+        std::ifstream schedstat(task + "/schedstat");
+        if (!(schedstat >> out.run_ns >> out.wait_ns >> out.slices)) return false;
+        std::ifstream status(task + "/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, 27, "nonvoluntary_ctxt_switches:") == 0) {
+                out.involuntary = strtoull(line.c_str() + 27, nullptr, 10);
+            }
+        }
+        out.at_us = now_us();
+        return true;
+    }
+};
+
+static ThreadPlacer g_thread_placer;
+
+// Registers the calling thread with g_thread_placer for its lifetime
+class ThreadScope {
+public:
+    ThreadScope(const std::string& role, const std::string& label) {
+        g_thread_placer.enter(role, label);
+    }
+    ~ThreadScope() {
+        g_thread_placer.leave();
+    }
+};
+
+// Bounded queue of encoded packets between the encoder and one sink
+struct PacketQueue {
+    std::queue<AVPacket*> queue;
+    std::mutex mtx;
+    std::condition_variable cond;
+    size_t max_size = 64;
+    bool quit = false;
+
+    std::condition_variable space;
+
+    // Returns false when full, the caller keeps the packet
+    bool push(AVPacket* pkt) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (queue.size() >= max_size) return false;
+        queue.push(pkt);
+        cond.notify_one();
+        return true;
+    }
+
+    // Waits for room instead, returns false on quit and the caller keeps the packet
+    bool push_wait(AVPacket* pkt) {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (queue.size() >= max_size && !quit) {
+            space.wait(lock);
+        }
+        if (quit) return false;
+        queue.push(pkt);
+        cond.notify_one();
+        return true;
+    }
+
+    // Blocks until a packet is available, returns nullptr on quit
+    AVPacket* pop() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (queue.empty() && !quit) {
+            cond.wait(lock);
+        }
+        if (quit) return nullptr;
+        AVPacket* pkt = queue.front();
+        queue.pop();
+        space.notify_one();
+        return pkt;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return queue.size();
+    }
+
+    void wake_and_quit() {
+        std::lock_guard<std::mutex> lock(mtx);
+        quit = true;
+        cond.notify_all();
+        space.notify_all();
+    }
+
+    void drain() {
+        std::lock_guard<std::mutex> lock(mtx);
+        while (!queue.empty()) {
+            av_packet_free(&queue.front());
+            queue.pop();
+        }
+    }
+};
+
+// An output of the encoder, or of the pass-through relay. Every packet goes
+// to every output by reference and no output may block the caller.
+class Output {
+public:
+    // How loaded the output was since the previous take_load(): the deepest
+    // its queue got and the mean time a write took
+    struct Load {
+        bool connected = false;
+        size_t peak_queued = 0;
+        int64_t mean_write_us = 0;
+    };
+
+    virtual ~Output() = default;
+
+    // Stream parameters of the packets this output will receive
+    virtual bool configure(const AVCodecParameters* codecpar, AVRational time_base) = 0;
+    virtual void start() = 0;
+    virtual void stop() = 0;
+    virtual void join() = 0;
+    virtual void send(const AVPacket* pkt) = 0;
+    // True once each time the output wants the encoder to emit an IDR now
+    virtual bool take_keyframe_request() = 0;
+    virtual Load take_load() = 0;
+    virtual std::string stats() = 0;
+};
+
+// An output fed through its own bounded queue, drained by a writer thread of
+// the subclass. send() takes a new reference and never blocks. After an
+// overflow the output skips packets until the next keyframe so what it
+// writes stays decodable.
+class QueuedOutput : public Output {
+public:
+    QueuedOutput(const std::string& url, size_t queue_depth) : url_(url) {
+        queue_.max_size = queue_depth;
+    }
+
+    void stop() override {
+        queue_.wake_and_quit();
+    }
+
+    // Encoder side
+    void send(const AVPacket* pkt) override {
+        bool key = pkt->flags & AV_PKT_FLAG_KEY;
+        if (resync_ && !key) {
+            dropped_++;
+            return;
+        }
+
+        AVPacket* ref = av_packet_clone(pkt);
+        if (!ref) {
+            dropped_++;
+            resync_ = true;
+            return;
+        }
+        if (!queue_.push(ref)) {
+            av_packet_free(&ref);
+            dropped_++;
+            peak_queued_ = queue_.max_size;
+            if (!resync_) {
+                LOGF(LOG_WARNING, "Output ", url_, " falling behind, dropping until next keyframe");
+            }
+            resync_ = true;
+            return;
+        }
+        resync_ = false;
+        peak_queued_ = std::max(peak_queued_, queue_.size());
+    }
+
+    // Encoder side. True once each time the writer set keyframe_wanted_.
+    bool take_keyframe_request() override {
+        return keyframe_wanted_.load(std::memory_order_relaxed) && keyframe_wanted_.exchange(false);
+    }
+
+    // Encoder side
+    Load take_load() override {
+        Load load;
+        load.connected = connected();
+        load.peak_queued = std::max(peak_queued_, queue_.size());
+        peak_queued_ = 0;
+        uint64_t writes = window_writes_.exchange(0);
+        int64_t write_us = window_write_us_.exchange(0);
+        if (writes) load.mean_write_us = write_us / static_cast<int64_t>(writes);
+        return load;
+    }
+
+    const std::string& url() const { return url_; }
+
+protected:
+    const std::string url_;
+    PacketQueue queue_;
+    std::atomic<bool> keyframe_wanted_{false};
+    std::atomic<uint64_t> dropped_{0};
+
+    // Whether the writer has somewhere to write right now
+    virtual bool connected() const { return true; }
+
+    // Writer side, once per write with how long it took
+    void record_write(int64_t us) {
+        window_write_us_.fetch_add(us, std::memory_order_relaxed);
+        window_writes_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    bool resync_ = false;                 // encoder thread only
+    size_t peak_queued_ = 0;              // encoder thread only
+    std::atomic<uint64_t> window_writes_{0};
+    std::atomic<int64_t> window_write_us_{0};
+};
+
+// One output of the encoder (RTSP push, local file, another server). The
+// encoder hands every packet to every sink by reference; each sink has its
+// own bounded queue and writer thread, so a slow or reconnecting output
+// never stalls the encoder or the other outputs.
+class PacketSink : public QueuedOutput {
+public:
+    PacketSink(const std::string& url, size_t queue_depth) : QueuedOutput(url, queue_depth) {}
+
+    ~PacketSink() override {
+        stop();
+        join();
+        queue_.drain();
+        close_output();
+        avcodec_parameters_free(&codecpar_);
+    }
+
+    bool configure(const AVCodecParameters* codecpar, AVRational time_base) override {
+        codecpar_ = avcodec_parameters_alloc();
+        if (!codecpar_ || avcodec_parameters_copy(codecpar_, codecpar) < 0) {
+            g_logger.log(LOG_ERROR, "Failed to copy codec parameters for " + url_);
+            return false;
+        }
+        time_base_ = time_base;
+        return true;
+    }
+
+    void start() override {
+        writer_thread_ = std::thread(&PacketSink::writer_loop, this);
+    }
+
+    void join() override {
+        if (writer_thread_.joinable()) writer_thread_.join();
+    }
+
+    std::string stats() override {
+        return url_ + (connected_ ? " connected" : " disconnected") +
+               " reconnects=" + std::to_string(reconnects_.load()) +
+               " queued=" + std::to_string(queue_.size()) +
+               " dropped=" + std::to_string(dropped_.load()) +
+               " written=" + std::to_string(written_.load()) +
+               " | send: " + send_latency_.summary() +
+               " | capture-to-send: " + end_to_end_latency_.summary();
+    }
+
+protected:
+    bool connected() const override { return connected_; }
+
+private:
+    AVCodecParameters* codecpar_ = nullptr;
+    AVRational time_base_ = {1, 1};
+    AVFormatContext* output_ctx_ = nullptr;
+    bool header_written_ = false;
+    std::atomic<bool> connected_{false};  // read by stats()
+    std::atomic<uint64_t> reconnects_{0};
+
+    std::thread writer_thread_;
+    std::atomic<uint64_t> written_{0};
+    LatencyHistogram send_latency_;       // av_interleaved_write_frame
+    LatencyHistogram end_to_end_latency_; // capture -> written, from pkt->opaque
+
+    static constexpr milliseconds kMinBackoff{250};
+    static constexpr milliseconds kMaxBackoff{5000};
+
+    const char* format_name() const {
+        if (url_.find("rtsp://") == 0) return "rtsp";
+        if (url_.find("rtmp://") == 0) return "flv";
+        if (url_.find("udp://") == 0 || url_.find("srt://") == 0 || url_.find("tcp://") == 0) return "mpegts";
+        return nullptr; // guess from the file extension
+    }
+
+    bool open_output() {
+        int ret = avformat_alloc_output_context2(&output_ctx_, nullptr, format_name(), url_.c_str());
+        if (!output_ctx_) {
+            g_logger.log(LOG_ERROR, "Failed to create output context for " + url_);
+            return false;
+        }
+
+        AVStream* stream = avformat_new_stream(output_ctx_, nullptr);
+        if (!stream) {
+            g_logger.log(LOG_ERROR, "Failed to create output stream");
+            close_output();
+            return false;
+        }
+
+        avcodec_parameters_copy(stream->codecpar, codecpar_);
+        stream->time_base = time_base_;
+
+        if (!(output_ctx_->oformat->flags & AVFMT_NOFILE)) {
+            ret = avio_open(&output_ctx_->pb, output_ctx_->url, AVIO_FLAG_WRITE);
+            if (ret < 0) {
+                ERROR_STR(ret);
+                g_logger.log(LOG_ERROR, std::string("Failed to open output IO: ") + errbuf);
+                close_output();
+                return false;
+            }
+        }
+
+        ret = avformat_write_header(output_ctx_, nullptr);
+        if (ret < 0) {
+            ERROR_STR(ret);
+            g_logger.log(LOG_ERROR, std::string("Failed to write header: ") + errbuf);
+            close_output();
+            return false;
+        }
+        header_written_ = true;
+        connected_ = true;
+
+        g_logger.log(LOG_INFO, std::string("Output initialized to ") + url_);
+        return true;
+    }
+
+    void close_output() {
+        if (!output_ctx_) return;
+        if (header_written_) av_write_trailer(output_ctx_);
+        if (!(output_ctx_->oformat->flags & AVFMT_NOFILE) && output_ctx_->pb) avio_closep(&output_ctx_->pb);
+        avformat_free_context(output_ctx_);
+        output_ctx_ = nullptr;
+        header_written_ = false;
+        connected_ = false;
+    }
+
+    // Sleeps until the next reconnect attempt. Keeps draining the queue so the
+    // encoder never sees it full; stale packets are useless after a reconnect.
+    // Returns false on stop.
+    bool wait_disconnected(milliseconds delay) {
+        auto retry_at = steady_clock::now() + delay;
+        std::unique_lock<std::mutex> lock(queue_.mtx);
+        while (!queue_.quit) {
+            while (!queue_.queue.empty()) {
+                av_packet_free(&queue_.queue.front());
+                queue_.queue.pop();
+                dropped_++;
+            }
+            if (steady_clock::now() >= retry_at) return true;
+            queue_.cond.wait_until(lock, retry_at);
+        }
+        return false;
+    }
+
+    void writer_loop() {
+        ThreadScope scope("output", url_);
+        g_logger.log(LOG_INFO, "Writer thread started for " + url_);
+        bool need_keyframe = true;
+        bool was_connected = false;
+        milliseconds backoff = kMinBackoff;
+
+        while (true) {
+            if (!output_ctx_) {
+                if (!open_output()) {
+                    LOGF(LOG_WARNING, "Output ", url_, " initialization failed, retrying in ", backoff.count(), " ms...");
+                    if (!wait_disconnected(backoff)) break;
+                    backoff = std::min(backoff * 2, kMaxBackoff);
+                    continue;
+                }
+                backoff = kMinBackoff;
+                if (was_connected) reconnects_++;
+                was_connected = true;
+                need_keyframe = true;
+                // An IDR now instead of making the new connection wait a whole GOP
+                keyframe_wanted_ = true;
+            }
+
+            AVPacket* pkt = queue_.pop();
+            if (!pkt) break;
+
+            // A fresh connection has to start on a keyframe
+            if (need_keyframe && !(pkt->flags & AV_PKT_FLAG_KEY)) {
+                av_packet_free(&pkt);
+                dropped_++;
+                continue;
+            }
+            need_keyframe = false;
+
+            int64_t origin_us = reinterpret_cast<intptr_t>(pkt->opaque);
+            pkt->stream_index = 0;
+            av_packet_rescale_ts(pkt, time_base_, output_ctx_->streams[0]->time_base);
+
+            int64_t send_start = now_us();
+            int ret = av_interleaved_write_frame(output_ctx_, pkt);
+            int64_t send_end = now_us();
+            av_packet_free(&pkt);
+
+            if (ret < 0) {
+                ERROR_STR(ret);
+                LOGF(LOG_ERROR, "Error writing packet to ", url_, ": ", errbuf);
+                close_output();
+                continue;
+            }
+
+            written_++;
+            send_latency_.record(send_end - send_start);
+            record_write(send_end - send_start);
+            if (origin_us) {
+                end_to_end_latency_.record(send_end - origin_us);
+            }
+        }
+
+        g_logger.log(LOG_INFO, "Writer thread stopped for " + url_);
+    }
+};
+
+// H.264 over RTP (RFC 6184). NAL units that fit the payload size go out whole,
+// larger ones as FU-A fragments. Access units may be Annex B (start codes) or
+// length prefixed (avcC), whichever the encoder or the input produced.
+struct H264Rtp {
+    static constexpr uint32_t kClockRate = 90000;
+    static constexpr uint8_t kPayloadType = 96;
+    static constexpr size_t kHeaderSize = 12;
+
+    static bool annex_b(const uint8_t* data, size_t size) {
+        return size >= 3 && data[0] == 0 && data[1] == 0 && (data[2] == 1 || (size >= 4 && data[2] == 0 && data[3] == 1));
+    }
+
+    // Calls emit(nal, size) for each NAL unit in the access unit
+    template <typename Emit>
+    static void for_each_nal(const uint8_t* data, size_t size, Emit&& emit) {
+        const uint8_t* end = data + size;
+        if (!annex_b(data, size)) {
+            while (end - data >= 4) {
+                size_t len = (static_cast<size_t>(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+                data += 4;
+                if (len > static_cast<size_t>(end - data)) break;
+                if (len) emit(data, len);
+                data += len;
+            }
+            return;
+        }
+        const uint8_t* start = next_start_code(data, end);
+        while (start < end) {
+            const uint8_t* nal = start + 3;
+            start = next_start_code(nal, end);
+            // Zeros before the next start code belong to it (4-byte start codes, trailing_zero_8bits)
+            const uint8_t* nal_end = start;
+            while (nal_end > nal && nal_end[-1] == 0) nal_end--;
+            if (nal_end > nal) emit(nal, static_cast<size_t>(nal_end - nal));
+        }
+    }
+
+    // Calls emit(prefix, prefix_size, payload, payload_size, marker) for each
+    // RTP payload of the access unit. prefix is the FU indicator and header
+    // of a fragment (prefix_size 2), or empty for a whole NAL unit; it only
+    // lives for the call. Access unit delimiters are left out.
+    template <typename Emit>
+    static void packetize(const uint8_t* data, size_t size, size_t max_payload, Emit&& emit) {
+        const uint8_t* pending = nullptr;
+        size_t pending_size = 0;
+        auto flush = [&](bool last) {
+            if (!pending) return;
+            if (pending_size <= max_payload) {
+                emit(nullptr, 0, pending, pending_size, last);
+                return;
+            }
+            uint8_t fu[2];
+            fu[0] = (pending[0] & 0xE0) | 28;
+            const uint8_t* p = pending + 1;
+            size_t remaining = pending_size - 1;
+            bool first = true;
+            while (remaining) {
+                size_t chunk = std::min(remaining, max_payload - 2);
+                bool end = chunk == remaining;
+                fu[1] = (pending[0] & 0x1F) | (first ? 0x80 : 0) | (end ? 0x40 : 0);
+                emit(fu, 2, p, chunk, last && end);
+                p += chunk;
+                remaining -= chunk;
+                first = false;
+            }
+        };
+        for_each_nal(data, size, [&](const uint8_t* nal, size_t nal_size) {
+            if ((nal[0] & 0x1F) == 9) return;
+            flush(false);
+            pending = nal;
+            pending_size = nal_size;
+        });
+        flush(true);
+    }
+
+    // The rtpmap and fmtp lines of the video media description
+    static std::string sdp_attributes(const AVCodecParameters* par) {
+        return "a=rtpmap:" + std::to_string(kPayloadType) + " H264/" + std::to_string(kClockRate) + "\r\n" +
+               fmtp(par) + "\r\n";
+    }
+
+    static void write_header(uint8_t* out, bool marker, uint16_t seq, uint32_t timestamp, uint32_t ssrc) {
+        out[0] = 0x80;
+        out[1] = (marker ? 0x80 : 0) | kPayloadType;
+        out[2] = seq >> 8;
+        out[3] = seq & 0xFF;
+        out[4] = timestamp >> 24;
+        out[5] = (timestamp >> 16) & 0xFF;
+        out[6] = (timestamp >> 8) & 0xFF;
+        out[7] = timestamp & 0xFF;
+        out[8] = ssrc >> 24;
+        out[9] = (ssrc >> 16) & 0xFF;
+        out[10] = (ssrc >> 8) & 0xFF;
+        out[11] = ssrc & 0xFF;
+    }
+
+    // a=fmtp line for an SDP. SPS and PPS come from the extradata when the
+    // encoder has global headers, otherwise viewers get them in band.
+    static std::string fmtp(const AVCodecParameters* par) {
+        std::vector<std::pair<const uint8_t*, size_t>> sets;
+        const uint8_t* extradata = par->extradata;
+        size_t size = par->extradata_size > 0 ? par->extradata_size : 0;
+        if (size >= 7 && extradata[0] == 1) {
+            // avcC: skip the 5 byte header, then SPS count, SPS, PPS count, PPS
+            const uint8_t* p = extradata + 5;
+            const uint8_t* end = extradata + size;
+            for (int list = 0; list < 2 && p < end; list++) {
+                int count = list == 0 ? (*p++ & 0x1F) : *p++;
+                for (int i = 0; i < count && end - p >= 2; i++) {
+                    size_t len = (p[0] << 8) | p[1];
+                    p += 2;
+                    if (len > static_cast<size_t>(end - p)) break;
+                    sets.emplace_back(p, len);
+                    p += len;
+                }
+            }
+        } else if (size) {
+            for_each_nal(extradata, size, [&](const uint8_t* nal, size_t len) {
+                int type = nal[0] & 0x1F;
+                if (type == 7 || type == 8) sets.emplace_back(nal, len);
+            });
+        }
+
+        std::string line = "a=fmtp:" + std::to_string(kPayloadType) + " packetization-mode=1";
+        std::string sprop;
+        for (const auto& set : sets) {
+            if ((set.first[0] & 0x1F) == 7 && set.second >= 4) {
+                char profile[16];
+                snprintf(profile, sizeof(profile), "%02x%02x%02x", set.first[1], set.first[2], set.first[3]);
+                line += std::string(";profile-level-id=") + profile;
+            }
+            std::vector<char> b64(AV_BASE64_SIZE(set.second));
+            if (!av_base64_encode(b64.data(), static_cast<int>(b64.size()), set.first, static_cast<int>(set.second))) continue;
+            sprop += (sprop.empty() ? "" : ",") + std::string(b64.data());
+        }
+        if (!sprop.empty()) line += ";sprop-parameter-sets=" + sprop;
+        return line;
+    }
+
+private:
+    static const uint8_t* next_start_code(const uint8_t* p, const uint8_t* end) {
+        for (; end - p >= 3; p++) {
+            if (p[0] == 0 && p[1] == 0 && p[2] == 1) return p;
+        }
+        return end;
+    }
+};
+
+// Serves viewers directly, no external RTSP server and no extra hop. Listed
+// in the output list as rtsp-server://[address]:port/path; viewers open
+// rtsp://host:port/path. RTP goes over the RTSP connection (interleaved TCP),
+// UDP setups are answered 461 so clients retry with TCP. Each viewer has its
+// own bounded queue and writer thread and starts at a keyframe; one that
+// can't keep up skips to the next keyframe without affecting the others.
+class RtspServer : public Output {
+public:
+    RtspServer(const std::string& url, size_t queue_depth) : url_(url), queue_depth_(queue_depth) {}
+
+    ~RtspServer() override {
+        stop();
+        join();
+        if (listen_fd_ >= 0) close(listen_fd_);
+        if (wake_fd_ >= 0) close(wake_fd_);
+        avcodec_parameters_free(&codecpar_);
+    }
+
+    // Binds right away, a port already in use fails init instead of the first viewer
+    bool configure(const AVCodecParameters* codecpar, AVRational time_base) override {
+        if (codecpar->codec_id != AV_CODEC_ID_H264) {
+            g_logger.log(LOG_ERROR, "The built-in RTSP server only serves H.264: " + url_);
+            return false;
+        }
+        codecpar_ = avcodec_parameters_alloc();
+        if (!codecpar_ || avcodec_parameters_copy(codecpar_, codecpar) < 0) {
+            g_logger.log(LOG_ERROR, "Failed to copy codec parameters for " + url_);
+            return false;
+        }
+        time_base_ = time_base;
+        return listen_on_url();
+    }
+
+    void start() override {
+        server_thread_ = std::thread(&RtspServer::server_loop, this);
+    }
+
+    void stop() override {
+        if (quit_.exchange(true) || wake_fd_ < 0) return;
+        uint64_t one = 1;
+        ssize_t ret = write(wake_fd_, &one, sizeof(one));
+        (void)ret;
+    }
+
+    void join() override {
+        if (server_thread_.joinable()) server_thread_.join();
+    }
+
+    // Encoder side, never blocks
+    void send(const AVPacket* pkt) override {
+        bool key = pkt->flags & AV_PKT_FLAG_KEY;
+        std::lock_guard<std::mutex> lock(clients_mtx_);
+        for (auto& client : clients_) {
+            if (!client->playing) continue;
+            if (client->resync && !key) {
+                client->dropped++;
+                continue;
+            }
+            AVPacket* ref = av_packet_clone(pkt);
+            if (!ref || !client->queue.push(ref)) {
+                av_packet_free(&ref);
+                client->dropped++;
+                if (!client->resync) {
+                    LOGF(LOG_WARNING, "Viewer ", client->peer, " falling behind, dropping until next keyframe");
+                }
+                client->resync = true;
+                continue;
+            }
+            client->resync = false;
+        }
+    }
+
+    bool take_keyframe_request() override {
+        return keyframe_wanted_.load(std::memory_order_relaxed) && keyframe_wanted_.exchange(false);
+    }
+
+    // Viewers on slow links skip frames on their own, they don't get to lower
+    // the bitrate for everybody else
+    Load take_load() override { return Load(); }
+
+    std::string stats() override {
+        size_t viewers = 0;
+        uint64_t dropped = dropped_;
+        uint64_t written = written_;
+        {
+            std::lock_guard<std::mutex> lock(clients_mtx_);
+            for (auto& client : clients_) {
+                if (client->playing) viewers++;
+                dropped += client->dropped;
+                written += client->written;
+            }
+        }
+        return url_ + " viewers=" + std::to_string(viewers) +
+               " served=" + std::to_string(served_.load()) +
+               " dropped=" + std::to_string(dropped) +
+               " written=" + std::to_string(written);
+    }
+
+private:
+    struct Client {
+        int fd = -1;
+        std::string peer;
+        std::string session;
+        std::string inbuf;             // server thread only
+        bool set_up = false;           // server thread only
+        uint8_t channel = 0;           // interleaved RTP channel
+        std::mutex write_mtx;          // held by whoever writes to the socket; the server thread only try-locks
+        std::mutex outbox_mtx;         // never held across a blocking call
+        std::string outbox;            // RTSP replies not sent yet
+        PacketQueue queue;
+        std::thread writer;
+        std::atomic<bool> playing{false};
+        std::atomic<bool> failed{false};
+        bool resync = true;            // encoder thread only, start at a keyframe
+        uint16_t seq = 0;
+        uint32_t ssrc = 0;
+        uint32_t rtp_offset = 0;
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<uint64_t> written{0};
+    };
+
+    static constexpr size_t kMaxClients = 16;
+    static constexpr size_t kMaxPayload = 1400;
+    static constexpr size_t kMaxRequest = 16 * 1024;
+    static constexpr int kSendTimeoutSec = 5;
+
+    const std::string url_;
+    const size_t queue_depth_;
+    std::string path_;
+    AVCodecParameters* codecpar_ = nullptr;
+    AVRational time_base_ = {1, 1};
+    int listen_fd_ = -1;
+    int wake_fd_ = -1;
+    std::atomic<bool> quit_{false};
+    std::thread server_thread_;
+    std::mt19937 random_{std::random_device{}()};  // server thread only
+
+    std::mutex clients_mtx_;  // the list and the playing flags; the encoder iterates it in send()
+    std::vector<std::unique_ptr<Client>> clients_;
+    std::atomic<bool> keyframe_wanted_{false};
+    std::atomic<uint64_t> served_{0};
+    std::atomic<uint64_t> dropped_{0};  // of viewers that left
+    std::atomic<uint64_t> written_{0};
+
+    bool listen_on_url() {
+        // rtsp-server://[address]:port/path
+        std::string rest = url_.substr(url_.find("://") + 3);
+        size_t slash = rest.find('/');
+        path_ = slash == std::string::npos ? "" : rest.substr(slash + 1);
+        std::string host_port = rest.substr(0, slash);
+        size_t colon = host_port.rfind(':');
+        std::string host = colon == std::string::npos ? "" : host_port.substr(0, colon);
+        int port = colon == std::string::npos ? 554 : atoi(host_port.c_str() + colon + 1);
+
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (!host.empty() && inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+            g_logger.log(LOG_ERROR, "Invalid RTSP server address: " + url_);
+            return false;
+        }
+
+        listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (listen_fd_ < 0 || wake_fd_ < 0) {
+            g_logger.log(LOG_ERROR, "Failed to create RTSP server sockets: " + std::string(strerror(errno)));
+            return false;
+        }
+        int one = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+            listen(listen_fd_, 8) < 0) {
+            g_logger.log(LOG_ERROR, "Failed to listen for " + url_ + ": " + std::string(strerror(errno)));
+            return false;
+        }
+        g_logger.log(LOG_INFO, "RTSP server listening on port " + std::to_string(port) + ", path /" + path_);
+        return true;
+    }
+
+    void server_loop() {
+        ThreadScope scope("output", url_);
+        g_logger.log(LOG_INFO, "RTSP server thread started for " + url_);
+        std::vector<pollfd> fds;
+        while (!quit_) {
+            fds.clear();
+            fds.push_back({wake_fd_, POLLIN, 0});
+            fds.push_back({listen_fd_, POLLIN, 0});
+            {
+                std::lock_guard<std::mutex> lock(clients_mtx_);
+                for (auto& client : clients_) {
+                    std::lock_guard<std::mutex> outbox_lock(client->outbox_mtx);
+                    fds.push_back({client->fd, static_cast<short>(POLLIN | (client->outbox.empty() ? 0 : POLLOUT)), 0});
+                }
+            }
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR) continue;
+                g_logger.log(LOG_ERROR, "RTSP server poll failed: " + std::string(strerror(errno)));
+                break;
+            }
+            if (fds[0].revents) break;
+            if (fds[1].revents & POLLIN) accept_client();
+
+            // Only the server thread adds or removes clients, indexes stay valid
+            for (size_t i = 2; i < fds.size(); i++) {
+                Client* client = clients_[i - 2].get();
+                if ((fds[i].revents & POLLOUT) && !flush_replies(client)) client->failed = true;
+                if ((fds[i].revents & ~POLLOUT) && !read_requests(client)) client->failed = true;
+            }
+            for (size_t i = clients_.size(); i-- > 0;) {
+                if (clients_[i]->failed) remove_client(i);
+            }
+        }
+        while (!clients_.empty()) remove_client(clients_.size() - 1);
+        g_logger.log(LOG_INFO, "RTSP server thread stopped for " + url_);
+    }
+
+    void accept_client() {
+        sockaddr_in addr = {};
+        socklen_t len = sizeof(addr);
+        int fd = accept4(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &len, SOCK_CLOEXEC);
+        if (fd < 0) return;
+
+        char host[INET_ADDRSTRLEN] = "?";
+        inet_ntop(AF_INET, &addr.sin_addr, host, sizeof(host));
+        std::string peer = std::string(host) + ":" + std::to_string(ntohs(addr.sin_port));
+        if (clients_.size() >= kMaxClients) {
+            LOGF(LOG_WARNING, "Refusing viewer ", peer, ", ", kMaxClients, " already connected");
+            close(fd);
+            return;
+        }
+
+        // A viewer that stops reading for this long is dropped instead of holding a writer forever
+        timeval timeout = {kSendTimeoutSec, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        std::unique_ptr<Client> client(new Client);
+        client->fd = fd;
+        client->peer = peer;
+        client->queue.max_size = queue_depth_;
+        client->ssrc = random_();
+        client->seq = random_();
+        client->rtp_offset = random_();
+        char session[17];
+        snprintf(session, sizeof(session), "%08x%08x", static_cast<unsigned>(random_()), static_cast<unsigned>(random_()));
+        client->session = session;
+
+        std::lock_guard<std::mutex> lock(clients_mtx_);
+        clients_.push_back(std::move(client));
+        g_logger.log(LOG_INFO, "Viewer connected: " + peer);
+    }
+
+    void remove_client(size_t index) {
+        std::unique_ptr<Client> client;
+        {
+            std::lock_guard<std::mutex> lock(clients_mtx_);
+            client = std::move(clients_[index]);
+            clients_.erase(clients_.begin() + index);
+        }
+        // The encoder can't reach it anymore; unblock and reap its writer.
+        // A last reply (TEARDOWN) still goes out if the writer is between frames.
+        client->queue.wake_and_quit();
+        flush_replies(client.get());
+        shutdown(client->fd, SHUT_RDWR);
+        if (client->writer.joinable()) client->writer.join();
+        client->queue.drain();
+        close(client->fd);
+        dropped_ += client->dropped;
+        written_ += client->written;
+        g_logger.log(LOG_INFO, "Viewer disconnected: " + client->peer);
+    }
+
+    // False when the connection is done (closed, torn down or broken)
+    bool read_requests(Client* client) {
+        char buf[4096];
+        ssize_t n = recv(client->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n == 0) return false;
+        if (n < 0) return errno == EAGAIN || errno == EINTR;
+        client->inbuf.append(buf, n);
+
+        while (!client->inbuf.empty()) {
+            // Interleaved data from the viewer (RTCP receiver reports), skipped
+            if (client->inbuf[0] == '$') {
+                if (client->inbuf.size() < 4) break;
+                size_t len = (static_cast<uint8_t>(client->inbuf[2]) << 8) | static_cast<uint8_t>(client->inbuf[3]);
+                if (client->inbuf.size() < 4 + len) break;
+                client->inbuf.erase(0, 4 + len);
+                continue;
+            }
+            size_t end = client->inbuf.find("\r\n\r\n");
+            if (end == std::string::npos) {
+                return client->inbuf.size() < kMaxRequest;
+            }
+            std::string request = client->inbuf.substr(0, end + 4);
+            size_t body = content_length(request);
+            if (client->inbuf.size() < end + 4 + body) break;
+            client->inbuf.erase(0, end + 4 + body);
+            if (!handle_request(client, request)) return false;
+        }
+        return true;
+    }
+
+    static std::string header(const std::string& request, const char* name) {
+        std::string key = std::string("\r\n") + name + ":";
+        auto it = std::search(request.begin(), request.end(), key.begin(), key.end(),
+                              [](char a, char b) { return tolower(a) == tolower(b); });
+        if (it == request.end()) return "";
+        size_t begin = (it - request.begin()) + key.size();
+        size_t end = request.find("\r\n", begin);
+        std::string value = request.substr(begin, end - begin);
+        value.erase(0, value.find_first_not_of(' '));
+        return value;
+    }
+
+    static size_t content_length(const std::string& request) {
+        std::string value = header(request, "Content-Length");
+        return value.empty() ? 0 : strtoul(value.c_str(), nullptr, 10);
+    }
+
+    bool handle_request(Client* client, const std::string& request) {
+        std::istringstream line(request.substr(0, request.find("\r\n")));
+        std::string method, uri;
+        line >> method >> uri;
+        std::string cseq = header(request, "CSeq");
+        LOGF(LOG_DEBUG, "RTSP ", method, " ", uri, " from ", client->peer);
+
+        if (method == "OPTIONS" || method == "GET_PARAMETER" || method == "SET_PARAMETER") {
+            return reply(client, cseq, "200 OK", method == "OPTIONS" ?
+                         "Public: OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN, GET_PARAMETER\r\n" : "");
+        }
+        if (method == "DESCRIBE") {
+            if (!serves(uri)) return reply(client, cseq, "404 Not Found", "");
+            std::string sdp =
+                "v=0\r\n"
+                "o=- " + client->session + " 1 IN IP4 0.0.0.0\r\n"
+                "s=streamout\r\n"
+                "c=IN IP4 0.0.0.0\r\n"
+                "t=0 0\r\n"
+                "a=control:*\r\n"
+                "m=video 0 RTP/AVP " + std::to_string(H264Rtp::kPayloadType) + "\r\n" +
+                H264Rtp::sdp_attributes(codecpar_) +
+                "a=control:track0\r\n";
+            return reply(client, cseq, "200 OK",
+                         "Content-Base: " + uri + "/\r\n"
+                         "Content-Type: application/sdp\r\n", sdp);
+        }
+        if (method == "SETUP") {
+            std::string transport = header(request, "Transport");
+            if (transport.find("RTP/AVP/TCP") == std::string::npos) {
+                return reply(client, cseq, "461 Unsupported Transport", "");
+            }
+            int rtp = 0, rtcp = 1;
+            size_t interleaved = transport.find("interleaved=");
+            if (interleaved != std::string::npos) {
+                sscanf(transport.c_str() + interleaved, "interleaved=%d-%d", &rtp, &rtcp);
+            }
+            client->channel = static_cast<uint8_t>(rtp);
+            client->set_up = true;
+            char ssrc[9];
+            snprintf(ssrc, sizeof(ssrc), "%08X", client->ssrc);
+            return reply(client, cseq, "200 OK",
+                         "Transport: RTP/AVP/TCP;unicast;interleaved=" + std::to_string(rtp) + "-" +
+                         std::to_string(rtcp) + ";ssrc=" + ssrc + "\r\n"
+                         "Session: " + client->session + ";timeout=60\r\n");
+        }
+        if (method == "PLAY") {
+            if (!client->set_up) return reply(client, cseq, "455 Method Not Valid in This State", "");
+            if (client->playing) return reply(client, cseq, "200 OK", "Session: " + client->session + "\r\n");
+            bool ok = reply(client, cseq, "200 OK",
+                            "Session: " + client->session + "\r\n"
+                            "Range: npt=0.000-\r\n");
+            client->writer = std::thread(&RtspServer::writer_loop, this, client);
+            {
+                std::lock_guard<std::mutex> lock(clients_mtx_);
+                client->playing = true;
+            }
+            served_++;
+            // Start the new viewer now instead of at the end of the GOP
+            keyframe_wanted_ = true;
+            LOGF(LOG_INFO, "Viewer ", client->peer, " playing /", path_);
+            return ok;
+        }
+        if (method == "TEARDOWN") {
+            reply(client, cseq, "200 OK", "Session: " + client->session + "\r\n");
+            return false;
+        }
+        return reply(client, cseq, "501 Not Implemented", "");
+    }
+
+    // Accepts rtsp://host[:port]/path with or without a trailing slash or track
+    bool serves(const std::string& uri) const {
+        size_t scheme = uri.find("://");
+        size_t slash = uri.find('/', scheme == std::string::npos ? 0 : scheme + 3);
+        std::string path = slash == std::string::npos ? "" : uri.substr(slash + 1);
+        while (!path.empty() && path.back() == '/') path.pop_back();
+        return path == path_;
+    }
+
+    bool reply(Client* client, const std::string& cseq, const std::string& status,
+               const std::string& headers, const std::string& body = "") {
+        std::string response = "RTSP/1.0 " + status + "\r\n"
+                               "CSeq: " + cseq + "\r\n"
+                               "Server: streamout\r\n" + headers;
+        if (!body.empty()) response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+        response += "\r\n" + body;
+
+        {
+            std::lock_guard<std::mutex> lock(client->outbox_mtx);
+            client->outbox += response;
+        }
+        return flush_replies(client);
+    }
+
+    // Server thread. Sends what the socket takes right now of the queued
+    // replies; a slow viewer must not stall the poll loop for everybody else.
+    // While the writer is sending, it takes the replies along with the next
+    // access unit instead. False when the connection is broken.
+    bool flush_replies(Client* client) {
+        std::unique_lock<std::mutex> write_lock(client->write_mtx, std::try_to_lock);
+        if (!write_lock.owns_lock()) return true;
+        std::lock_guard<std::mutex> lock(client->outbox_mtx);
+        while (!client->outbox.empty()) {
+            ssize_t n = ::send(client->fd, client->outbox.data(), client->outbox.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            client->outbox.erase(0, n);
+        }
+        return true;
+    }
+
+    // sendmsg rather than writev for MSG_NOSIGNAL, a viewer hanging up must not SIGPIPE us
+    static bool send_all(int fd, iovec* iov, size_t count) {
+        while (count) {
+            msghdr msg = {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = std::min(count, static_cast<size_t>(IOV_MAX));
+            ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            while (count && static_cast<size_t>(n) >= iov->iov_len) {
+                n -= iov->iov_len;
+                iov++;
+                count--;
+            }
+            if (count) {
+                iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + n;
+                iov->iov_len -= n;
+            }
+        }
+        return true;
+    }
+
+    // One per playing viewer: packetizes its queue and writes each access
+    // unit with a single sendmsg. Each RTP packet is an interleave header,
+    // RTP header and FU bytes from headers, followed by the payload straight
+    // from the shared packet data.
+    void writer_loop(Client* client) {
+        ThreadScope scope("output", url_);
+        std::vector<std::array<uint8_t, 4 + H264Rtp::kHeaderSize + 2>> headers;
+        std::vector<size_t> header_sizes;
+        std::vector<std::pair<const uint8_t*, size_t>> payloads;
+        std::vector<iovec> iov;
+        std::string replies;
+
+        while (AVPacket* pkt = client->queue.pop()) {
+            uint32_t timestamp = client->rtp_offset +
+                static_cast<uint32_t>(av_rescale_q(pkt->pts, time_base_, {1, static_cast<int>(H264Rtp::kClockRate)}));
+            headers.clear();
+            header_sizes.clear();
+            payloads.clear();
+            H264Rtp::packetize(pkt->data, pkt->size, kMaxPayload,
+                               [&](const uint8_t* prefix, size_t prefix_size, const uint8_t* payload, size_t size, bool marker) {
+                headers.emplace_back();
+                uint8_t* h = headers.back().data();
+                size_t rtp_size = H264Rtp::kHeaderSize + prefix_size + size;
+                h[0] = '$';
+                h[1] = client->channel;
+                h[2] = rtp_size >> 8;
+                h[3] = rtp_size & 0xFF;
+                H264Rtp::write_header(h + 4, marker, client->seq++, timestamp, client->ssrc);
+                if (prefix_size) memcpy(h + 4 + H264Rtp::kHeaderSize, prefix, prefix_size);
+                header_sizes.push_back(4 + H264Rtp::kHeaderSize + prefix_size);
+                payloads.emplace_back(payload, size);
+            });
+
+            iov.clear();
+            for (size_t i = 0; i < headers.size(); i++) {
+                iov.push_back({headers[i].data(), header_sizes[i]});
+                iov.push_back({const_cast<uint8_t*>(payloads[i].first), payloads[i].second});
+            }
+            bool ok;
+            {
+                std::lock_guard<std::mutex> lock(client->write_mtx);
+                // Replies the server thread couldn't send go first, in order
+                {
+                    std::lock_guard<std::mutex> outbox_lock(client->outbox_mtx);
+                    replies.swap(client->outbox);
+                }
+                if (!replies.empty()) iov.insert(iov.begin(), {&replies[0], replies.size()});
+                ok = send_all(client->fd, iov.data(), iov.size());
+                replies.clear();
+            }
+            av_packet_free(&pkt);
+            if (!ok) {
+                LOGF(LOG_WARNING, "Viewer ", client->peer, " write failed: ", strerror(errno));
+                client->failed = true;
+                // Wakes the server thread's poll so it reaps this viewer
+                shutdown(client->fd, SHUT_RDWR);
+                break;
+            }
+            client->written++;
+        }
+    }
+};
+
+// Sends RTP/H.264 straight over UDP, unicast or multicast, without a
+// muxer: rtp://host:port[?ttl=N&localaddr=IP&pkt_size=N&sdp=FILE]. Datagrams
+// go out in batches with sendmmsg, each one an RTP header slot from a reused
+// pool plus the payload straight from the shared packet data. A large access
+// unit is paced over part of the frame interval in kBurst sized batches, so
+// an I-frame doesn't hit the switch as one multi-hundred-kilobyte burst.
+// Receivers need the SDP, written to FILE when given and logged either way.
+class RtpSink : public QueuedOutput {
+public:
+    RtpSink(const std::string& url, size_t queue_depth) : QueuedOutput(url, queue_depth) {}
+
+    ~RtpSink() override {
+        stop();
+        join();
+        queue_.drain();
+        if (fd_ >= 0) close(fd_);
+        avcodec_parameters_free(&codecpar_);
+    }
+
+    bool configure(const AVCodecParameters* codecpar, AVRational time_base) override {
+        if (codecpar->codec_id != AV_CODEC_ID_H264) {
+            g_logger.log(LOG_ERROR, "The RTP output only sends H.264: " + url_);
+            return false;
+        }
+        codecpar_ = avcodec_parameters_alloc();
+        if (!codecpar_ || avcodec_parameters_copy(codecpar_, codecpar) < 0) {
+            g_logger.log(LOG_ERROR, "Failed to copy codec parameters for " + url_);
+            return false;
+        }
+        time_base_ = time_base;
+        return open_socket();
+    }
+
+    void start() override {
+        // Receivers can't decode anything before the first IDR
+        keyframe_wanted_ = true;
+        writer_thread_ = std::thread(&RtpSink::writer_loop, this);
+    }
+
+    void join() override {
+        if (writer_thread_.joinable()) writer_thread_.join();
+    }
+
+    std::string stats() override {
+        uint64_t datagrams = datagrams_.load();
+        uint64_t calls = syscalls_.load();
+        return url_ + " frames=" + std::to_string(frames_.load()) +
+               " datagrams=" + std::to_string(datagrams) +
+               " sendmmsg=" + std::to_string(calls) +
+               " (" + std::to_string(calls ? static_cast<double>(datagrams) / calls : 0.0) + " per call)" +
+               " send_errors=" + std::to_string(send_errors_.load()) +
+               " queued=" + std::to_string(queue_.size()) +
+               " dropped=" + std::to_string(dropped_.load()) +
+               " | send: " + send_latency_.summary();
+    }
+
+private:
+    // One datagram: iov[0] is the RTP header (and FU bytes) in header, iov[1] the payload
+    struct Datagram {
+        uint8_t header[H264Rtp::kHeaderSize + 2];
+        iovec iov[2];
+    };
+
+    static constexpr size_t kBurst = 16;            // datagrams per sendmmsg, ~22 KB at the default size
+    static constexpr int64_t kPaceShare = 2;        // pace over 1/kPaceShare of the frame interval
+    static constexpr int64_t kDefaultFrameUs = 33333;
+    static constexpr int kSendBuffer = 1024 * 1024;
+
+    AVCodecParameters* codecpar_ = nullptr;
+    AVRational time_base_ = {1, 1};
+    int fd_ = -1;
+    size_t max_payload_ = 1400 - H264Rtp::kHeaderSize;
+    std::string sdp_file_;
+
+    std::thread writer_thread_;
+
+    // Writer thread only. The pool only grows, to the largest access unit seen;
+    // a deque so the iovecs pointing into earlier datagrams survive the growth.
+    std::deque<Datagram> pool_;
+    std::vector<mmsghdr> msgs_;
+    uint16_t seq_ = 0;
+    uint32_t ssrc_ = 0;
+    uint32_t rtp_offset_ = 0;
+    int64_t last_pts_ = AV_NOPTS_VALUE;
+    int64_t frame_us_ = kDefaultFrameUs;
+
+    std::atomic<uint64_t> frames_{0};
+    std::atomic<uint64_t> datagrams_{0};
+    std::atomic<uint64_t> syscalls_{0};
+    std::atomic<uint64_t> send_errors_{0};
+    LatencyHistogram send_latency_;  // whole access unit, pacing sleeps excluded
+
+    bool open_socket() {
+        // rtp://host:port[?key=value&...]
+        std::string rest = url_.substr(strlen("rtp://"));
+        std::string query;
+        size_t question = rest.find('?');
+        if (question != std::string::npos) {
+            query = rest.substr(question + 1);
+            rest.erase(question);
+        }
+        while (!rest.empty() && rest.back() == '/') rest.pop_back();
+        size_t colon = rest.rfind(':');
+        if (colon == std::string::npos) {
+            g_logger.log(LOG_ERROR, "RTP output needs host:port: " + url_);
+            return false;
+        }
+        std::string host = rest.substr(0, colon);
+        int port = atoi(rest.c_str() + colon + 1);
+
+        int ttl = 1;
+        std::string localaddr;
+        for (const std::string& option : split_list(query, '&')) {
+            size_t eq = option.find('=');
+            if (eq == std::string::npos) continue;
+            std::string key = option.substr(0, eq);
+            std::string value = option.substr(eq + 1);
+            if (key == "ttl") ttl = atoi(value.c_str());
+            else if (key == "localaddr") localaddr = value;
+            else if (key == "pkt_size") max_payload_ = std::max(64, atoi(value.c_str())) - H264Rtp::kHeaderSize;
+            else if (key == "sdp") sdp_file_ = value;
+            else g_logger.log(LOG_WARNING, "Unknown RTP output option " + key + " in " + url_);
+        }
+
+        sockaddr_in dest = {};
+        dest.sin_family = AF_INET;
+        dest.sin_port = htons(port);
+        if (port <= 0 || inet_pton(AF_INET, host.c_str(), &dest.sin_addr) != 1) {
+            g_logger.log(LOG_ERROR, "Invalid RTP destination (IPv4 address and port): " + url_);
+            return false;
+        }
+        bool multicast = IN_MULTICAST(ntohl(dest.sin_addr.s_addr));
+
+        fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd_ < 0) {
+            g_logger.log(LOG_ERROR, "Failed to create RTP socket: " + std::string(strerror(errno)));
+            return false;
+        }
+        int sndbuf = kSendBuffer;
+        setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        if (multicast) {
+            setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+            if (!localaddr.empty()) {
+                in_addr iface = {};
+                if (inet_pton(AF_INET, localaddr.c_str(), &iface) != 1 ||
+                    setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) < 0) {
+                    g_logger.log(LOG_ERROR, "Invalid multicast interface address: " + localaddr);
+                    return false;
+                }
+            }
+        } else if (!localaddr.empty()) {
+            sockaddr_in local = {};
+            local.sin_family = AF_INET;
+            if (inet_pton(AF_INET, localaddr.c_str(), &local.sin_addr) != 1 ||
+                bind(fd_, reinterpret_cast<sockaddr*>(&local), sizeof(local)) < 0) {
+                g_logger.log(LOG_ERROR, "Failed to bind RTP output to " + localaddr);
+                return false;
+            }
+        }
+        // Connected, so sendmmsg needs no per-message address
+        if (connect(fd_, reinterpret_cast<sockaddr*>(&dest), sizeof(dest)) < 0) {
+            g_logger.log(LOG_ERROR, "Failed to connect RTP socket to " + url_ + ": " + strerror(errno));
+            return false;
+        }
+
+        std::random_device random;
+        ssrc_ = random();
+        seq_ = random();
+        rtp_offset_ = random();
+
+        std::string sdp = "v=0\r\n"
+                          "o=- " + std::to_string(ssrc_) + " 1 IN IP4 " + (localaddr.empty() ? "0.0.0.0" : localaddr) + "\r\n"
+                          "s=streamout\r\n"
+                          "c=IN IP4 " + host + (multicast ? "/" + std::to_string(ttl) : "") + "\r\n"
+                          "t=0 0\r\n"
+                          "m=video " + std::to_string(port) + " RTP/AVP " + std::to_string(H264Rtp::kPayloadType) + "\r\n" +
+                          H264Rtp::sdp_attributes(codecpar_);
+        if (!sdp_file_.empty()) {
+            std::ofstream out(sdp_file_, std::ios::trunc);
+            out << sdp;
+            if (!out) g_logger.log(LOG_WARNING, "Failed to write SDP to " + sdp_file_);
+        }
+        g_logger.log(LOG_INFO, std::string("RTP output to ") + host + ":" + std::to_string(port) +
+                  (multicast ? " (multicast, ttl " + std::to_string(ttl) + ")" : "") + ", SDP:\n" + sdp);
+        return true;
+    }
+
+    // Builds every datagram of the access unit into the pool, then returns how many
+    size_t packetize(const AVPacket* pkt) {
+        uint32_t timestamp = rtp_offset_ +
+            static_cast<uint32_t>(av_rescale_q(pkt->pts, time_base_, {1, static_cast<int>(H264Rtp::kClockRate)}));
+        size_t count = 0;
+        H264Rtp::packetize(pkt->data, pkt->size, max_payload_,
+                           [&](const uint8_t* prefix, size_t prefix_size, const uint8_t* payload, size_t size, bool marker) {
+            if (count == pool_.size()) pool_.emplace_back();
+            Datagram& d = pool_[count++];
+            H264Rtp::write_header(d.header, marker, seq_++, timestamp, ssrc_);
+            if (prefix_size) memcpy(d.header + H264Rtp::kHeaderSize, prefix, prefix_size);
+            d.iov[0] = {d.header, H264Rtp::kHeaderSize + prefix_size};
+            d.iov[1] = {const_cast<uint8_t*>(payload), size};
+        });
+        return count;
+    }
+
+    // Sends datagrams [begin, end) with as few sendmmsg calls as the kernel allows
+    void send_batch(size_t begin, size_t end) {
+        if (msgs_.size() < pool_.size()) msgs_.resize(pool_.size());
+        for (size_t i = begin; i < end; i++) {
+            msgs_[i] = {};
+            msgs_[i].msg_hdr.msg_iov = pool_[i].iov;
+            msgs_[i].msg_hdr.msg_iovlen = 2;
+        }
+        while (begin < end) {
+            int sent = sendmmsg(fd_, &msgs_[begin], end - begin, 0);
+            syscalls_++;
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                // ICMP unreachable on a connected socket, or no buffer space: lose this batch, not the stream
+                send_errors_++;
+                LOGF(LOG_DEBUG, "RTP send to ", url_, " failed: ", strerror(errno));
+                return;
+            }
+            datagrams_ += sent;
+            begin += sent;
+        }
+    }
+
+    // Frame interval from the pts step, for pacing
+    void update_frame_interval(const AVPacket* pkt) {
+        if (last_pts_ != AV_NOPTS_VALUE && pkt->pts > last_pts_) {
+            int64_t us = av_rescale_q(pkt->pts - last_pts_, time_base_, {1, 1000000});
+            frame_us_ = std::min<int64_t>(std::max<int64_t>(us, 5000), 200000);
+        }
+        last_pts_ = pkt->pts;
+    }
+
+    void writer_loop() {
+        ThreadScope scope("output", url_);
+        g_logger.log(LOG_INFO, "Writer thread started for " + url_);
+        while (AVPacket* pkt = queue_.pop()) {
+            update_frame_interval(pkt);
+            size_t count = packetize(pkt);
+
+            // Pace over part of the frame interval, less of it when frames are
+            // already waiting so the queue doesn't grow behind the pacing
+            int64_t window_us = frame_us_ / kPaceShare / static_cast<int64_t>(1 + queue_.size());
+            size_t bursts = (count + kBurst - 1) / kBurst;
+            int64_t gap_us = bursts > 1 ? window_us / static_cast<int64_t>(bursts - 1) : 0;
+
+            int64_t start = now_us();
+            int64_t busy_us = 0;
+            timespec next;
+            clock_gettime(CLOCK_MONOTONIC, &next);
+            for (size_t begin = 0; begin < count; begin += kBurst) {
+                if (begin && gap_us > 0) {
+                    next.tv_nsec += gap_us * 1000;
+                    while (next.tv_nsec >= 1000000000) {
+                        next.tv_nsec -= 1000000000;
+                        next.tv_sec++;
+                    }
+                    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
+                }
+                int64_t send_start = now_us();
+                send_batch(begin, std::min(count, begin + kBurst));
+                busy_us += now_us() - send_start;
+            }
+            av_packet_free(&pkt);
+
+            frames_++;
+            send_latency_.record(busy_us);
+            record_write(busy_us);
+            LOGF(LOG_DEBUG, "RTP frame: ", count, " datagrams in ", now_us() - start, " us");
+        }
+        g_logger.log(LOG_INFO, "Writer thread stopped for " + url_);
+    }
+};
+
+// Low-latency HLS for browsers, written straight into a directory (meant to
+// be a tmpfs) that any local HTTP server can serve: hls:///dev/shm/cam0
+// [?segment=SECONDS&part=SECONDS&window=N]. FFmpeg's mp4 muxer cuts an fMP4
+// fragment at every part boundary; each part becomes its own file right away
+// and the parts of a segment are concatenated into the segment file when the
+// next keyframe closes it. index.m3u8 lists the last N segments, with their
+// parts near the live edge, and is replaced atomically after every part.
+// Older segments are unlinked as they leave the window, so the directory
+// stays the same size. Blocking playlist reload and preload hints need a
+// server that holds requests, so neither is advertised; players poll.
+class HlsSink : public QueuedOutput {
+public:
+    HlsSink(const std::string& url, size_t queue_depth) : QueuedOutput(url, queue_depth) {}
+
+    ~HlsSink() override {
+        stop();
+        join();
+        queue_.drain();
+        close_muxer();
+        avcodec_parameters_free(&codecpar_);
+    }
+
+    bool configure(const AVCodecParameters* codecpar, AVRational time_base) override {
+        if (codecpar->codec_id != AV_CODEC_ID_H264 && codecpar->extradata_size <= 0) {
+            g_logger.log(LOG_ERROR, "The HLS output needs H.264 or a stream with global headers: " + url_);
+            return false;
+        }
+        codecpar_ = avcodec_parameters_alloc();
+        if (!codecpar_ || avcodec_parameters_copy(codecpar_, codecpar) < 0) {
+            g_logger.log(LOG_ERROR, "Failed to copy codec parameters for " + url_);
+            return false;
+        }
+        time_base_ = time_base;
+        return parse_url() && prepare_directory();
+    }
+
+    void start() override {
+        // Nothing can be published before the first IDR
+        keyframe_wanted_ = true;
+        writer_thread_ = std::thread(&HlsSink::writer_loop, this);
+    }
+
+    void join() override {
+        if (writer_thread_.joinable()) writer_thread_.join();
+    }
+
+    std::string stats() override {
+        return url_ + " segments=" + std::to_string(segments_written_.load()) +
+               " parts=" + std::to_string(parts_written_.load()) +
+               " bytes=" + std::to_string(bytes_written_.load()) +
+               " file_errors=" + std::to_string(file_errors_.load()) +
+               " queued=" + std::to_string(queue_.size()) +
+               " dropped=" + std::to_string(dropped_.load()) +
+               " | part: " + part_latency_.summary() +
+               " | capture-to-part: " + end_to_end_latency_.summary();
+    }
+
+private:
+    struct Part {
+        double duration;
+        bool independent;
+    };
+
+    struct Segment {
+        uint64_t sequence = 0;
+        double duration = 0;
+        std::vector<Part> parts;
+    };
+
+    static constexpr const char* kPlaylist = "index.m3u8";
+    static constexpr const char* kInit = "init.mp4";
+    static constexpr int kPartWindow = 3;   // parts are listed for the last 3 target durations
+
+    std::string dir_;
+    double segment_seconds_ = 2.0;
+    double part_seconds_ = 0.5;
+    size_t window_ = 6;
+    AVCodecParameters* codecpar_ = nullptr;
+    AVRational time_base_ = {1, 1};
+
+    std::thread writer_thread_;
+
+    // Writer thread only
+    AVFormatContext* muxer_ = nullptr;
+    int64_t segment_ticks_ = 0;         // targets in time_base_
+    int64_t part_ticks_ = 0;
+    int64_t frame_ticks_ = 0;           // last pts step
+    int64_t last_pts_ = AV_NOPTS_VALUE;
+    int64_t segment_start_ = AV_NOPTS_VALUE;
+    int64_t part_start_ = AV_NOPTS_VALUE;
+    int64_t part_origin_us_ = 0;        // capture time of the part's first frame
+    bool part_independent_ = false;
+    bool keyframe_asked_ = false;       // for the current segment
+    int part_frames_ = 0;
+    std::string segment_data_;          // the parts of the open segment so far
+    Segment current_;
+    std::deque<Segment> segments_;      // closed, oldest first, at most window_
+
+    std::atomic<uint64_t> segments_written_{0};
+    std::atomic<uint64_t> parts_written_{0};
+    std::atomic<uint64_t> bytes_written_{0};
+    std::atomic<uint64_t> file_errors_{0};
+    LatencyHistogram part_latency_;       // fragment flush plus file writes
+    LatencyHistogram end_to_end_latency_; // capture of a part's first frame -> part published
+
+    bool parse_url() {
+        // hls://DIR[?key=value&...], DIR absolute
+        std::string rest = url_.substr(strlen("hls://"));
+        std::string query;
+        size_t question = rest.find('?');
+        if (question != std::string::npos) {
+            query = rest.substr(question + 1);
+            rest.erase(question);
+        }
+        while (rest.size() > 1 && rest.back() == '/') rest.pop_back();
+        if (rest.empty()) {
+            g_logger.log(LOG_ERROR, "HLS output needs a directory: " + url_);
+            return false;
+        }
+        dir_ = rest;
+
+        for (const std::string& option : split_list(query, '&')) {
+            size_t eq = option.find('=');
+            if (eq == std::string::npos) continue;
+            std::string key = option.substr(0, eq);
+            double value = atof(option.c_str() + eq + 1);
+            if (key == "segment") segment_seconds_ = value;
+            else if (key == "part") part_seconds_ = value;
+            else if (key == "window") window_ = static_cast<size_t>(std::max(value, 0.0));
+            else g_logger.log(LOG_WARNING, "Unknown HLS output option " + key + " in " + url_);
+        }
+        if (part_seconds_ < 0.05 || segment_seconds_ < part_seconds_ || window_ < 3) {
+            g_logger.log(LOG_ERROR, "HLS output needs part >= 0.05 s, segment >= part and window >= 3: " + url_);
+            return false;
+        }
+        segment_ticks_ = av_rescale_q(static_cast<int64_t>(segment_seconds_ * 1000000), {1, 1000000}, time_base_);
+        part_ticks_ = av_rescale_q(static_cast<int64_t>(part_seconds_ * 1000000), {1, 1000000}, time_base_);
+        return true;
+    }
+
+    // Creates the directory if needed and clears what an earlier run left, so
+    // players never mix in stale segments with the same names
+    bool prepare_directory() {
+        if (mkdir(dir_.c_str(), 0755) < 0 && errno != EEXIST) {
+            g_logger.log(LOG_ERROR, "Failed to create HLS directory " + dir_ + ": " + strerror(errno));
+            return false;
+        }
+        DIR* dir = opendir(dir_.c_str());
+        if (!dir) {
+            g_logger.log(LOG_ERROR, "Failed to open HLS directory " + dir_ + ": " + strerror(errno));
+            return false;
+        }
+        while (dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            bool ours = name == kPlaylist || name == kInit ||
+                        (name.compare(0, 3, "seg") == 0 && name.size() > 4 && name.compare(name.size() - 4, 4, ".m4s") == 0);
+            if (ours) unlink((dir_ + "/" + name).c_str());
+        }
+        closedir(dir);
+        g_logger.log(LOG_INFO, "HLS output to " + dir_ + "/" + kPlaylist + ", segments of " +
+                     std::to_string(segment_seconds_) + " s in parts of " + std::to_string(part_seconds_) + " s");
+        return true;
+    }
+
+    static std::string segment_name(uint64_t sequence) {
+        return "seg" + std::to_string(sequence) + ".m4s";
+    }
+
+    static std::string part_name(uint64_t sequence, size_t index) {
+        return "seg" + std::to_string(sequence) + "." + std::to_string(index) + ".m4s";
+    }
+
+    // Writes a file under a temporary name and renames it, so the HTTP
+    // server never serves half of one
+    bool write_file(const std::string& name, const void* data, size_t size) {
+        std::string path = dir_ + "/" + name;
+        std::string tmp = dir_ + "/." + name + ".tmp";
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = fd >= 0;
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        while (ok && size) {
+            ssize_t n = write(fd, p, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                ok = false;
+                break;
+            }
+            p += n;
+            size -= n;
+            bytes_written_ += n;
+        }
+        if (fd >= 0) close(fd);
+        if (ok && rename(tmp.c_str(), path.c_str()) == 0) return true;
+        if (file_errors_++ == 0) {
+            g_logger.log(LOG_ERROR, "Failed to write HLS file " + path + ": " + strerror(errno));
+        }
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    // Takes what the muxer wrote since the last call. The dynamic buffer is
+    // reopened so the muxer always has somewhere to write.
+    bool take_muxed(std::string& out) {
+        uint8_t* buf = nullptr;
+        int size = avio_close_dyn_buf(muxer_->pb, &buf);
+        muxer_->pb = nullptr;
+        if (size > 0) out.append(reinterpret_cast<const char*>(buf), size);
+        av_free(buf);
+        return avio_open_dyn_buf(&muxer_->pb) >= 0;
+    }
+
+    // Without global headers the SPS and PPS only come in band; the init
+    // segment needs them, so they are copied from the first keyframe
+    bool fill_extradata(const AVPacket* pkt) {
+        if (codecpar_->extradata_size > 0) return true;
+        std::string sets;
+        H264Rtp::for_each_nal(pkt->data, pkt->size, [&](const uint8_t* nal, size_t size) {
+            int type = nal[0] & 0x1F;
+            if (type != 7 && type != 8) return;
+            sets.append("\0\0\0\1", 4);
+            sets.append(reinterpret_cast<const char*>(nal), size);
+        });
+        if (sets.empty()) return false;
+        codecpar_->extradata = static_cast<uint8_t*>(av_mallocz(sets.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+        if (!codecpar_->extradata) return false;
+        memcpy(codecpar_->extradata, sets.data(), sets.size());
+        codecpar_->extradata_size = static_cast<int>(sets.size());
+        return true;
+    }
+
+    // Sets up the fragmenting muxer on the first keyframe and writes init.mp4
+    bool open_muxer(const AVPacket* pkt) {
+        if (!fill_extradata(pkt)) {
+            g_logger.log(LOG_ERROR, "No SPS/PPS in the first keyframe for " + url_);
+            return false;
+        }
+        avformat_alloc_output_context2(&muxer_, nullptr, "mp4", nullptr);
+        if (!muxer_) {
+            g_logger.log(LOG_ERROR, "Failed to create mp4 muxer for " + url_);
+            return false;
+        }
+        AVStream* stream = avformat_new_stream(muxer_, nullptr);
+        if (!stream || avcodec_parameters_copy(stream->codecpar, codecpar_) < 0 ||
+            avio_open_dyn_buf(&muxer_->pb) < 0) {
+            g_logger.log(LOG_ERROR, "Failed to set up mp4 muxer for " + url_);
+            close_muxer();
+            return false;
+        }
+        stream->codecpar->codec_tag = 0;
+        stream->time_base = time_base_;
+
+        // Empty moov up front, then a moof+mdat each time a part is cut
+        AVDictionary* options = nullptr;
+        av_dict_set(&options, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+        int ret = avformat_write_header(muxer_, &options);
+        av_dict_free(&options);
+        if (ret < 0) {
+            ERROR_STR(ret);
+            g_logger.log(LOG_ERROR, std::string("Failed to write mp4 header for ") + url_ + ": " + errbuf);
+            close_muxer();
+            return false;
+        }
+        std::string init;
+        if (!take_muxed(init) || !write_file(kInit, init.data(), init.size())) {
+            close_muxer();
+            return false;
+        }
+        return true;
+    }
+
+    void close_muxer() {
+        if (!muxer_) return;
+        if (muxer_->pb) {
+            uint8_t* buf = nullptr;
+            avio_close_dyn_buf(muxer_->pb, &buf);
+            av_free(buf);
+            muxer_->pb = nullptr;
+        }
+        avformat_free_context(muxer_);
+        muxer_ = nullptr;
+    }
+
+    // Cuts the fragment at end (time_base_), publishes it as a part and
+    // appends it to the open segment
+    bool close_part(int64_t end) {
+        if (!part_frames_) return true;
+        int64_t start_us = now_us();
+        std::string part;
+        if (av_write_frame(muxer_, nullptr) < 0 || !take_muxed(part)) {
+            g_logger.log(LOG_ERROR, "Failed to cut an HLS part for " + url_);
+            return false;
+        }
+        write_file(part_name(current_.sequence, current_.parts.size()), part.data(), part.size());
+        segment_data_ += part;
+
+        double duration = (end - part_start_) * av_q2d(time_base_);
+        current_.parts.push_back({duration, part_independent_});
+        current_.duration += duration;
+        part_frames_ = 0;
+        write_playlist(false);
+
+        int64_t end_us = now_us();
+        parts_written_++;
+        part_latency_.record(end_us - start_us);
+        record_write(end_us - start_us);
+        if (part_origin_us_) end_to_end_latency_.record(end_us - part_origin_us_);
+        return true;
+    }
+
+    // Publishes the open segment as one file and drops the oldest from the window
+    void close_segment() {
+        if (current_.parts.empty()) return;
+        write_file(segment_name(current_.sequence), segment_data_.data(), segment_data_.size());
+        segment_data_.clear();
+        segments_written_++;
+
+        uint64_t next = current_.sequence + 1;
+        segments_.push_back(std::move(current_));
+        current_ = Segment();
+        current_.sequence = next;
+        keyframe_asked_ = false;
+
+        while (segments_.size() > window_) {
+            const Segment& old = segments_.front();
+            unlink((dir_ + "/" + segment_name(old.sequence)).c_str());
+            for (size_t i = 0; i < old.parts.size(); i++) {
+                unlink((dir_ + "/" + part_name(old.sequence, i)).c_str());
+            }
+            segments_.pop_front();
+        }
+    }
+
+    void write_playlist(bool ended) {
+        double longest = segment_seconds_;
+        for (const Segment& segment : segments_) longest = std::max(longest, segment.duration);
+        int target = static_cast<int>(std::ceil(longest));
+
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(5);
+        out << "#EXTM3U\n"
+               "#EXT-X-VERSION:6\n"
+               "#EXT-X-TARGETDURATION:" << target << "\n"
+               "#EXT-X-PART-INF:PART-TARGET=" << part_seconds_ << "\n"
+               "#EXT-X-SERVER-CONTROL:PART-HOLD-BACK=" << 3 * part_seconds_ << "\n"
+               "#EXT-X-MEDIA-SEQUENCE:" << (segments_.empty() ? current_.sequence : segments_.front().sequence) << "\n"
+               "#EXT-X-MAP:URI=\"" << kInit << "\"\n";
+
+        // Parts only near the live edge, where players that join late use them
+        double listed = current_.duration;
+        size_t first_with_parts = segments_.size();
+        while (first_with_parts > 0 && listed + segments_[first_with_parts - 1].duration <= kPartWindow * target) {
+            first_with_parts--;
+            listed += segments_[first_with_parts].duration;
+        }
+        auto write_parts = [&](const Segment& segment) {
+            for (size_t i = 0; i < segment.parts.size(); i++) {
+                out << "#EXT-X-PART:DURATION=" << segment.parts[i].duration
+                    << ",URI=\"" << part_name(segment.sequence, i) << "\""
+                    << (segment.parts[i].independent ? ",INDEPENDENT=YES" : "") << "\n";
+            }
+        };
+        for (size_t i = 0; i < segments_.size(); i++) {
+            if (i >= first_with_parts) write_parts(segments_[i]);
+            out << "#EXTINF:" << segments_[i].duration << ",\n" << segment_name(segments_[i].sequence) << "\n";
+        }
+        write_parts(current_);
+        if (ended) out << "#EXT-X-ENDLIST\n";
+
+        std::string playlist = out.str();
+        write_file(kPlaylist, playlist.data(), playlist.size());
+    }
+
+    // Drops the unfinished segment after a muxer error; the next keyframe starts over
+    void abandon_segment() {
+        for (size_t i = 0; i < current_.parts.size(); i++) {
+            unlink((dir_ + "/" + part_name(current_.sequence, i)).c_str());
+        }
+        current_.parts.clear();
+        current_.duration = 0;
+        segment_data_.clear();
+        part_frames_ = 0;
+        close_muxer();
+    }
+
+    void write_packet(AVPacket* pkt) {
+        bool key = pkt->flags & AV_PKT_FLAG_KEY;
+        if (!muxer_ && (!key || !open_muxer(pkt))) {
+            dropped_++;
+            return;
+        }
+        if (pkt->pts == AV_NOPTS_VALUE) pkt->pts = last_pts_ == AV_NOPTS_VALUE ? 0 : last_pts_ + frame_ticks_;
+        if (pkt->dts == AV_NOPTS_VALUE) pkt->dts = pkt->pts;
+        if (last_pts_ != AV_NOPTS_VALUE && pkt->pts > last_pts_) frame_ticks_ = pkt->pts - last_pts_;
+        if (frame_ticks_ <= 0) frame_ticks_ = std::max<int64_t>(1, av_rescale_q(1, {1, 30}, time_base_));
+        last_pts_ = pkt->pts;
+
+        // Segments start on keyframes. One is asked for a frame ahead, so an
+        // encoder that honours it closes the segment right on target.
+        bool segment_due = segment_start_ != AV_NOPTS_VALUE && pkt->pts - segment_start_ >= segment_ticks_;
+        if (segment_due && key) {
+            if (!close_part(pkt->pts)) {
+                abandon_segment();
+                return;
+            }
+            close_segment();
+        } else if (segment_start_ != AV_NOPTS_VALUE && !keyframe_asked_ &&
+                   pkt->pts + frame_ticks_ - segment_start_ >= segment_ticks_) {
+            // Read by the encoder through take_keyframe_request()
+            keyframe_wanted_ = true;
+            keyframe_asked_ = true;
+        }
+        if (current_.parts.empty() && !part_frames_) segment_start_ = pkt->pts;
+        if (!part_frames_) {
+            part_start_ = pkt->pts;
+            part_independent_ = key;
+            part_origin_us_ = reinterpret_cast<intptr_t>(pkt->opaque);
+        }
+
+        int64_t end = pkt->pts + frame_ticks_;
+        pkt->stream_index = 0;
+        pkt->duration = frame_ticks_;
+        av_packet_rescale_ts(pkt, time_base_, muxer_->streams[0]->time_base);
+        int ret = av_write_frame(muxer_, pkt);
+        if (ret < 0) {
+            ERROR_STR(ret);
+            LOGF(LOG_ERROR, "Error muxing HLS packet for ", url_, ": ", errbuf);
+            abandon_segment();
+            return;
+        }
+        part_frames_++;
+
+        // Cut as soon as one more frame would overrun the part target, so
+        // the part goes out without waiting for the next packet
+        if (end + frame_ticks_ - part_start_ > part_ticks_ && !close_part(end)) abandon_segment();
+    }
+
+    void writer_loop() {
+        ThreadScope scope("output", url_);
+        g_logger.log(LOG_INFO, "Writer thread started for " + url_);
+        while (AVPacket* pkt = queue_.pop()) {
+            write_packet(pkt);
+            av_packet_free(&pkt);
+        }
+        if (muxer_ && close_part(last_pts_ + frame_ticks_)) {
+            close_segment();
+            write_playlist(true);
+        }
+        g_logger.log(LOG_INFO, "Writer thread stopped for " + url_);
+    }
+};
+
+// Adjusts the encoder bitrate, and the frame rate as a last resort, to what
+// the outputs can take. Once per interval it looks at the most loaded
+// connected output. Congested means the queue holds more than kHighQueueMs of
+// video, or writes take most of a frame interval (a writer that spends all its
+// time blocked in the socket is the bottleneck). Congestion cuts the bitrate
+// by a quarter right away, but not again while the queue is already draining.
+// Going back up needs a run of clear intervals and goes in 10% steps. A raise
+// that ends in a cut doubles the run the next raise needs, each raise that
+// holds shortens it again, so probing a link on the edge slows down instead
+// of sawing up and down. At the minimum bitrate,
+// continued congestion halves the frame rate (down to a quarter); the frame
+// rate comes back before the bitrate does.
+class BitrateController {
+public:
+    void init(int64_t min_bitrate, int64_t max_bitrate, int fps) {
+        min_bitrate_ = min_bitrate;
+        max_bitrate_ = max_bitrate;
+        fps_ = fps;
+        bitrate_ = max_bitrate;
+    }
+
+    bool due(int64_t now) {
+        if (now < next_check_us_) return false;
+        next_check_us_ = now + kIntervalUs;
+        return true;
+    }
+
+    // One interval's worth of load from the worst output. True when the
+    // bitrate or the frame rate changed.
+    bool update(size_t queued_packets, int64_t mean_write_us) {
+        int divisor = fps_divisor_;
+        int64_t queue_ms = static_cast<int64_t>(queued_packets) * 1000 * divisor / fps_;
+        int64_t frame_us = 1000000LL * divisor / fps_;
+        bool congested = queue_ms > kHighQueueMs || mean_write_us > frame_us * 3 / 4;
+        bool clear = queue_ms < kLowQueueMs && mean_write_us < frame_us / 4;
+        bool draining = queue_ms < last_queue_ms_;
+        last_queue_ms_ = queue_ms;
+
+        if (congested) {
+            clear_intervals_ = 0;
+            if (draining && mean_write_us <= frame_us * 3 / 4) return false;
+            int64_t bitrate = bitrate_;
+            if (bitrate > min_bitrate_) {
+                bitrate_ = std::max(min_bitrate_, bitrate * 3 / 4);
+                if (probing_) raise_after_ = std::min(raise_after_ * 2, kMaxRaiseAfter);
+                probing_ = false;
+                cuts_++;
+                return true;
+            }
+            if (divisor < kMaxFpsDivisor && ++congested_at_min_ >= kDecimateAfter) {
+                congested_at_min_ = 0;
+                fps_divisor_ = divisor * 2;
+                cuts_++;
+                return true;
+            }
+            return false;
+        }
+        congested_at_min_ = 0;
+        if (!clear) {
+            clear_intervals_ = 0;
+            return false;
+        }
+        if (++clear_intervals_ < raise_after_) return false;
+        clear_intervals_ = 0;
+        if (probing_) raise_after_ = std::max(kRaiseAfter, raise_after_ * 3 / 4);
+        if (divisor > 1) {
+            fps_divisor_ = divisor / 2;
+            raises_++;
+            return true;
+        }
+        int64_t bitrate = bitrate_;
+        if (bitrate < max_bitrate_) {
+            bitrate_ = std::min(max_bitrate_, bitrate + std::max(bitrate / 10, kMinStep));
+            probing_ = true;
+            raises_++;
+            return true;
+        }
+        return false;
+    }
+
+    // Encoder side, called once per frame. With a divisor of N only every Nth
+    // frame is encoded.
+    bool skip_frame() {
+        int divisor = fps_divisor_;
+        return divisor > 1 && (frame_counter_++ % divisor) != 0;
+    }
+
+    int64_t bitrate() const { return bitrate_; }
+    int fps() const { return fps_ / fps_divisor_; }
+
+    std::string stats() const {
+        return "bitrate=" + std::to_string(bitrate_.load() / 1000) + "kbps" +
+               " fps=" + std::to_string(fps()) +
+               " cuts=" + std::to_string(cuts_.load()) +
+               " raises=" + std::to_string(raises_.load());
+    }
+
+private:
+    static constexpr int64_t kIntervalUs = 500000;
+    static constexpr int64_t kHighQueueMs = 250;
+    static constexpr int64_t kLowQueueMs = 60;
+    static constexpr int kRaiseAfter = 6;       // 3 s clear before stepping up
+    static constexpr int kMaxRaiseAfter = 60;
+    static constexpr int kDecimateAfter = 4;    // 2 s congested at the minimum bitrate
+    static constexpr int kMaxFpsDivisor = 4;
+    static constexpr int64_t kMinStep = 100000;
+
+    int64_t min_bitrate_ = 0;
+    int64_t max_bitrate_ = 0;
+    int fps_ = 30;
+    int64_t next_check_us_ = 0;
+    int64_t last_queue_ms_ = 0;
+    int clear_intervals_ = 0;
+    int raise_after_ = kRaiseAfter;
+    bool probing_ = false;  // the last change was a bitrate raise
+    int congested_at_min_ = 0;
+    uint64_t frame_counter_ = 0;
+
+    // Written by the encode thread, read by dump_stats
+    std::atomic<int64_t> bitrate_{0};
+    std::atomic<int> fps_divisor_{1};
+    std::atomic<uint64_t> cuts_{0};
+    std::atomic<uint64_t> raises_{0};
+};
+
+// What capture does when the encoder falls behind and frame_queue_ is full
+enum QueuePolicy {
+    QUEUE_DROP_OLDEST,  // discard the oldest queued frame to make room
+    QUEUE_LATEST_WINS,  // mailbox: discard everything queued, the encoder only sees the newest frame
+    QUEUE_BLOCK         // stall capture until the encoder frees a slot, never drop
+};
+
+// Upper bound for --queue-depth. Latency stamps are kept per frame in a fixed
+// table; a deeper queue would let new frames overwrite stamps still in flight.
+static constexpr int kMaxFrameQueueDepth = 128;
+
+// Parameters to be configured 
+struct Config {
+    std::string input_url;
+    std::string output_url;
+    bool convert_rate = false; // input_fps -> output_fps from capture timestamps
+    double input_fps = 18; // which is xpi rk3566 zero
+    int output_fps = 30;
+    std::string video_size = "1280x1024";
+    int sink_queue_depth = 64; // encoded packets buffered per output
+    int64_t bitrate = 4000000; // encoder target, the ceiling when adaptive
+    int64_t min_bitrate = 0;   // > 0 enables adaptive bitrate, the floor it may cut to
+    bool passthrough = false;  // RTSP H.264 inputs: remux packets as they are, no decode/encode
+    int decode_threads = 0;    // compressed RTSP inputs, 0 picks one per core
+    int v4l2_buffers = 4;      // initial req.count, raised while the driver keeps dropping
+    bool fast_start = false;   // RTSP inputs: minimal probing when the cached stream parameters still match
+    bool rtsp_udp = false;     // RTSP inputs over RTP/UDP instead of interleaved TCP
+    int jitter_ms = 80;        // with rtsp_udp: how long a gap may hold back later packets before it counts as lost
+    std::string param_cache_file; // where fast start keeps them across restarts, empty keeps them in memory only
+    bool hflip = false;        // mirror the picture, for cameras mounted backwards (NV12/YUV420P)
+    int rotation = 0;          // clockwise degrees: 0, 90, 180 or 270, applied before the mirror
+    int frame_queue_depth = 8; // capture -> encode frames, rounded up to a power of two
+    QueuePolicy queue_policy = QUEUE_DROP_OLDEST;
+    std::string log_file = "streamer.log";
+    LogLevel log_level = LOG_INFO;
+    bool console_log = true;
+    bool async_log = false; // format and write logs on a background thread
+    std::map<std::string, ThreadPlacement> threads; // by role: capture, process, encode, output
+    bool lock_memory = false;  // mlockall once the pipelines are set up, before their threads start
+};
+
+// Codec parameters last seen on each RTSP input URL, so that reopening it can
+// skip most of avformat_find_stream_info. Shared by every streamer in the
+// process. With a file set, entries survive restarts: one line per URL, tab
+// separated, extradata in hex.
+class StreamParamCache {
+public:
+    struct Entry {
+        AVCodecID codec_id = AV_CODEC_ID_NONE;
+        int width = 0;
+        int height = 0;
+        int format = -1;
+        AVRational frame_rate = {0, 1};
+        std::vector<uint8_t> extradata;
+    };
+
+    void load(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        path_ = path;
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::vector<std::string> fields = split_list(line, '\t');
+            if (fields.size() != 8) continue;
+            Entry entry;
+            entry.codec_id = static_cast<AVCodecID>(atoi(fields[1].c_str()));
+            entry.width = atoi(fields[2].c_str());
+            entry.height = atoi(fields[3].c_str());
+            entry.format = atoi(fields[4].c_str());
+            entry.frame_rate = {atoi(fields[5].c_str()), atoi(fields[6].c_str())};
+            for (size_t i = 0; i + 1 < fields[7].size(); i += 2) {
+                entry.extradata.push_back(static_cast<uint8_t>(strtoul(fields[7].substr(i, 2).c_str(), nullptr, 16)));
+            }
+            entries_[fields[0]] = entry;
+        }
+        if (!entries_.empty()) {
+            g_logger.log(LOG_INFO, "Loaded stream parameters for " + std::to_string(entries_.size()) +
+                      " inputs from " + path);
+        }
+    }
+
+    bool find(const std::string& url, Entry& entry) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = entries_.find(url);
+        if (it == entries_.end()) return false;
+        entry = it->second;
+        return true;
+    }
+
+    void store(const std::string& url, const AVStream* stream) {
+        const AVCodecParameters* par = stream->codecpar;
+        Entry entry;
+        entry.codec_id = par->codec_id;
+        entry.width = par->width;
+        entry.height = par->height;
+        entry.format = par->format;
+        entry.frame_rate = stream->avg_frame_rate.den > 0 ? stream->avg_frame_rate : stream->r_frame_rate;
+        if (par->extradata_size > 0) entry.extradata.assign(par->extradata, par->extradata + par->extradata_size);
+
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = entries_.find(url);
+        if (it != entries_.end() && same(it->second, entry)) return;
+        entries_[url] = entry;
+        save();
+    }
+
+    // The minimal probe found nothing that contradicts the entry. Fields the
+    // probe didn't get to are not a mismatch, fill() supplies them.
+    static bool matches(const Entry& entry, const AVCodecParameters* par) {
+        if (par->codec_id != entry.codec_id) return false;
+        if (par->width && par->height && (par->width != entry.width || par->height != entry.height)) return false;
+        if (par->format >= 0 && par->format != entry.format) return false;
+        if (par->extradata_size > 0 &&
+            (static_cast<size_t>(par->extradata_size) != entry.extradata.size() ||
+             memcmp(par->extradata, entry.extradata.data(), entry.extradata.size()) != 0)) return false;
+        return true;
+    }
+
+    static bool fill(const Entry& entry, AVStream* stream) {
+        AVCodecParameters* par = stream->codecpar;
+        if (!par->width || !par->height) {
+            par->width = entry.width;
+            par->height = entry.height;
+        }
+        if (par->format < 0) par->format = entry.format;
+        if (!stream->avg_frame_rate.num && !stream->r_frame_rate.num) stream->avg_frame_rate = entry.frame_rate;
+        if (par->extradata_size <= 0 && !entry.extradata.empty()) {
+            par->extradata = static_cast<uint8_t*>(av_mallocz(entry.extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+            if (!par->extradata) return false;
+            memcpy(par->extradata, entry.extradata.data(), entry.extradata.size());
+            par->extradata_size = static_cast<int>(entry.extradata.size());
+        }
+        return true;
+    }
+
+private:
+    std::mutex mtx_;
+    std::map<std::string, Entry> entries_;
+    std::string path_;
+
+    static bool same(const Entry& a, const Entry& b) {
+        return a.codec_id == b.codec_id && a.width == b.width && a.height == b.height &&
+               a.format == b.format && av_cmp_q(a.frame_rate, b.frame_rate) == 0 && a.extradata == b.extradata;
+    }
+
+    // Written to a temporary file and renamed, a crash never leaves half a cache
+    void save() {
+        if (path_.empty()) return;
+        std::string tmp = path_ + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            for (const auto& [url, entry] : entries_) {
+                std::ostringstream hex;
+                hex << std::hex << std::setfill('0');
+                for (uint8_t byte : entry.extradata) hex << std::setw(2) << static_cast<int>(byte);
+                out << url << '\t' << entry.codec_id << '\t' << entry.width << '\t' << entry.height << '\t'
+                    << entry.format << '\t' << entry.frame_rate.num << '\t' << entry.frame_rate.den << '\t'
+                    << hex.str() << '\n';
+            }
+            if (!out) {
+                g_logger.log(LOG_WARNING, "Failed to write stream parameter cache " + tmp);
+                return;
+            }
+        }
+        if (rename(tmp.c_str(), path_.c_str()) < 0) {
+            g_logger.log(LOG_WARNING, "Failed to replace stream parameter cache " + path_);
+        }
+    }
+};
+
+static StreamParamCache g_stream_params;
+
+// What the RTP layer of a UDP RTSP input lost or received out of order.
+// damaged and out_of_order come from the packets themselves and are the loss
+// signals to go by. lost and late are scraped from FFmpeg's log messages
+// (rtpdec.c wording in FFmpeg 4.x to 7.x) and read 0 if a release rewords them.
+struct RtpInputStats {
+    std::atomic<uint64_t> damaged{0};      // frames the depacketizer flagged corrupt (missing fragments)
+    std::atomic<uint64_t> out_of_order{0}; // frames that still came out of the demuxer out of order
+    std::atomic<uint64_t> lost{0};         // best effort: given up on after the jitter window
+    std::atomic<uint64_t> late{0};         // best effort: arrived after their gap was given up on, discarded
+    bool scrape_warned = false;            // process thread only
+
+    std::string summary() const {
+        return "damaged=" + std::to_string(damaged.load()) +
+               " out_of_order=" + std::to_string(out_of_order.load()) +
+               " lost~" + std::to_string(lost.load()) +
+               " late~" + std::to_string(late.load());
+    }
+};
+
+// FFmpeg's RTP demuxer reports loss and late packets only through av_log.
+// Count them on the input that logged them, found through its
+// AVFormatContext::opaque, then log as usual. The callback is process-wide;
+// anything not from an input carrying RtpInputStats just passes through.
+static void rtp_log_callback(void* avcl, int level, const char* fmt, va_list vl) {
+    if (avcl && level == AV_LOG_WARNING && fmt && strncmp(fmt, "RTP: ", 5) == 0) {
+        const AVClass* cls = *static_cast<const AVClass**>(avcl);
+        RtpInputStats* stats = cls && strcmp(cls->class_name, "AVFormatContext") == 0 ?
+            static_cast<RtpInputStats*>(static_cast<AVFormatContext*>(avcl)->opaque) : nullptr;
+        if (stats && strcmp(fmt, "RTP: missed %d packets\n") == 0) {
+            va_list args;
+            va_copy(args, vl);
+            stats->lost += va_arg(args, int);
+            va_end(args);
+        } else if (stats && strcmp(fmt, "RTP: dropping old packet received too late\n") == 0) {
+            stats->late++;
+        }
+    }
+    av_log_default_callback(avcl, level, fmt, vl);
+}
+
+class VideoStreamer {
+public:
+    VideoStreamer(const Config& config) : config_(config), v4l2_buffer_count_(config.v4l2_buffers) {
+        g_logger.init(config_.log_file, config_.log_level, config_.console_log, config_.async_log);
+        frame_queue_.init(config_.frame_queue_depth);
+    }
+    ~VideoStreamer() { cleanup(); }
+
+    int init() {
+        g_logger.log(LOG_INFO, "Initializing video streamer...");
+        if (is_rtsp_source()) input_session_start_us_ = now_us();
+        
+        while (!init_input()) {
+            if (should_stop_) return -1;
+            g_logger.log(LOG_WARNING, "Input initialization failed, retrying in 5 seconds...");
+            if (wait_for_stop(5s)) return -1;
+        }
+
+        passthrough_ = config_.passthrough && can_passthrough();
+        if (passthrough_) {
+            // Relay only, the rate converter and encoder are never opened
+            return init_outputs() < 0 ? -1 : 0;
+        }
+
+        // Compressed RTSP inputs get a real decoder, it also sets the frame geometry the encoder uses
+        if (is_rtsp_source()) {
+            const AVCodecParameters* par = input_ctx_->streams[video_stream_index_]->codecpar;
+            if (par->codec_id != AV_CODEC_ID_RAWVIDEO) {
+                if (init_decoder() < 0) return -1;
+            } else {
+                v4l2_width_ = par->width;
+                v4l2_height_ = par->height;
+                v4l2_pix_fmt_ = static_cast<AVPixelFormat>(par->format);
+                raw_picture_size_ = av_image_get_buffer_size(v4l2_pix_fmt_, v4l2_width_, v4l2_height_, 1);
+                const AVStream* stream = input_ctx_->streams[video_stream_index_];
+                AVRational rate = stream->avg_frame_rate.den > 0 ? stream->avg_frame_rate : stream->r_frame_rate;
+                if (rate.num > 0 && rate.den > 0) raw_frame_duration_ = av_inv_q(rate);
+            }
+        }
+
+        if (transforms_picture()) {
+            if (v4l2_pix_fmt_ != AV_PIX_FMT_NV12 && v4l2_pix_fmt_ != AV_PIX_FMT_YUV420P) {
+                g_logger.log(LOG_ERROR, "Rotation and mirroring need NV12 or YUV420P input");
+                return -1;
+            }
+            g_logger.log(LOG_INFO, "Picture transform: rotate " + std::to_string(config_.rotation) +
+                      (config_.hflip ? ", mirror" : "") + ", " + mirror_kernels().name + " kernels, output " +
+                      std::to_string(out_width()) + "x" + std::to_string(out_height()));
+        }
+
+        // Queue depth plus what the rate converter, the encoder and the capture side hold at once.
+        // Pooled pixel buffers hold transformed pictures, so they take the output geometry.
+        if (!frame_pool_.init(out_width(), out_height(), v4l2_pix_fmt_,
+                              frame_queue_.capacity() + kFramePoolSlack)) {
+            g_logger.log(LOG_ERROR, "Failed to allocate frame pool");
+            return -1;
+        }
+
+        input_time_base_ = is_rtsp_source() ? input_ctx_->streams[video_stream_index_]->time_base : kV4L2TimeBase;
+        if (config_.convert_rate) {
+            if (!rate_converter_.init(input_time_base_, config_.output_fps)) return -1;
+            g_logger.log(LOG_INFO, "Frame rate conversion to " + std::to_string(config_.output_fps) + " fps");
+        }
+
+        if (init_encoder() < 0) return -1;
+
+        if (init_outputs() < 0) return -1;
+
+        g_logger.log(LOG_INFO, "Video streamer initialized successfully");
+        return 0;
+    }
+
+    bool is_rtsp_source() const {
+        return config_.input_url.find("rtsp://") == 0;
+    }
+
+    // Starts the encoder thread, and for RTSP inputs a demux thread plus a
+    // process thread that decodes or copies what it reads. V4L2 inputs are
+    // captured by a CaptureReactor the caller registers them with. A
+    // pass-through relay only has the demux thread.
+    void start() {
+        g_logger.log(LOG_INFO, "Starting video streamer threads for " + config_.input_url + "...");
+        bool process = is_rtsp_source() && !passthrough_;
+        threads_running_ = passthrough_ ? 1 : (process ? 3 : 2);
+        if (is_rtsp_source()) {
+            capture_thread_ = std::thread(&VideoStreamer::capture_loop_rtsp, this);
+        }
+        if (process) {
+            packet_queue_.max_size = decoder_ctx_ ? kPacketQueueDepth : kRawPacketQueueDepth;
+            process_thread_ = std::thread(&VideoStreamer::process_loop, this);
+        }
+        for (auto& sink : sinks_) {
+            sink->start();
+        }
+        if (!passthrough_) {
+            encode_thread_ = std::thread(&VideoStreamer::encode_loop, this);
+        }
+    }
+
+    bool running() const { return threads_running_ > 0; }
+
+    void join() {
+        if (capture_thread_.joinable()) capture_thread_.join();
+        if (process_thread_.joinable()) process_thread_.join();
+        if (encode_thread_.joinable()) encode_thread_.join();
+        for (auto& sink : sinks_) {
+            sink->stop();
+            sink->join();
+        }
+
+        g_logger.log(LOG_INFO, "Video streamer threads stopped for " + config_.input_url +
+                  ", dropped frames: " + std::to_string(dropped_frames()));
+    }
+
+    // Per-stage latency percentiles, logged on SIGUSR1 and at shutdown
+    void dump_stats() {
+        static const char* stage_names[STAGE_COUNT] = {
+            "sensor", "decode", "transform", "capture", "queue", "encode"
+        };
+        g_logger.log(LOG_INFO, "Pipeline stats for " + config_.input_url +
+                  ": queued=" + std::to_string(queued_frames()) +
+                  " dropped=" + std::to_string(dropped_frames()) +
+                  " loaned=" + std::to_string(loaned_v4l2_buffers()));
+        if (config_.convert_rate) {
+            g_logger.log(LOG_INFO, "Rate conversion: duplicated=" + std::to_string(rate_converter_.duplicated()) +
+                      " dropped=" + std::to_string(rate_converter_.dropped()));
+        }
+        // Flat "allocated" while "handed out" grows means zero frame allocations in steady state
+        g_logger.log(LOG_INFO, "Frame pool: allocated=" + std::to_string(frame_pool_.allocated()) +
+                  " handed_out=" + std::to_string(frame_pool_.handed_out()));
+
+        // Encoder throughput since the previous dump, should stay flat while outputs reconnect
+        int64_t now = now_us();
+        uint64_t encoded = encoded_packets_.load(std::memory_order_relaxed);
+        if (stats_since_us_ && now > stats_since_us_) {
+            double fps = (encoded - stats_since_packets_) * 1e6 / (now - stats_since_us_);
+            g_logger.log(LOG_INFO, std::string(passthrough_ ? "Relayed" : "Encoded") +
+                      " packets: " + std::to_string(encoded) +
+                      ", " + std::to_string(fps) + " fps since last dump");
+        }
+        if (!is_rtsp_source()) {
+            // Where the sensor's frames went: lost in the driver, dropped by our queue, or encoded
+            uint64_t sensor = v4l2_sensor_frames_.load(std::memory_order_relaxed);
+            double sensor_fps = stats_since_us_ && now > stats_since_us_ ?
+                (sensor - stats_since_sensor_frames_) * 1e6 / (now - stats_since_us_) : 0.0;
+            g_logger.log(LOG_INFO, "V4L2 frames: sensor=" + std::to_string(sensor) +
+                      " (" + std::to_string(sensor_fps) + " fps)" +
+                      " driver_dropped=" + std::to_string(v4l2_driver_drops_.load()) +
+                      " starved=" + std::to_string(v4l2_starved_.load()) +
+                      " queue_dropped=" + std::to_string(dropped_frames()) +
+                      " buffers=" + std::to_string(v4l2_buffer_count_.load()));
+            stats_since_sensor_frames_ = sensor;
+        }
+        stats_since_us_ = now;
+        stats_since_packets_ = encoded;
+#ifdef STREAMER_COUNT_ALLOCS
+        uint64_t frames = latency_[STAGE_CAPTURE].count();
+        g_logger.log(LOG_INFO, "Heap allocations: " + std::to_string(heap_allocs()) +
+                  " total, " + std::to_string(frames ? static_cast<double>(heap_allocs()) / frames : 0.0) + " per frame");
+#endif
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            g_logger.log(LOG_INFO, std::string("Latency ") + stage_names[i] + ": " + latency_[i].summary());
+        }
+        if (is_rtsp_source()) {
+            g_logger.log(LOG_INFO, "Input (re)connect to first frame: " + input_startup_.summary());
+            g_logger.log(LOG_INFO, std::string("Input ") + (config_.rtsp_udp ? "RTP/UDP" : "RTSP/TCP") +
+                      ": " + rtp_stats_.summary());
+        }
+        if (config_.min_bitrate > 0 && !passthrough_) {
+            g_logger.log(LOG_INFO, "Adaptive bitrate: " + bitrate_controller_.stats());
+        }
+        for (auto& sink : sinks_) {
+            g_logger.log(LOG_INFO, "Output " + sink->stats());
+        }
+    }
+
+    // Number of driver buffers currently held by frames in the pipeline
+    int loaned_v4l2_buffers() const { return v4l2_loaned_.load(); }
+
+    // Frames discarded by the queue policy, and frames waiting for the encoder
+    uint64_t dropped_frames() const { return dropped_frames_.load(); }
+    size_t queued_frames() const { return frame_queue_.size(); }
 
     void stop() {
         g_logger.log(LOG_INFO, "Stopping video streamer...");
-        should_stop_ = true;
+        {
+            std::lock_guard<std::mutex> lock(stop_mtx_);
+            should_stop_ = true;
+        }
+        stop_cond_.notify_all();
+        packet_queue_.wake_and_quit();
         frame_queue_.wake_and_quit();
     }
 
 private:
+    friend class CaptureReactor;
+
     const Config config_;
     std::atomic<bool> should_stop_{false};
+    std::mutex stop_mtx_;
+    std::condition_variable stop_cond_;
+
+    // Sleeps that stop() cuts short. True when stopping.
+    bool wait_for_stop(milliseconds delay) {
+        std::unique_lock<std::mutex> lock(stop_mtx_);
+        return stop_cond_.wait_for(lock, delay, [this] { return should_stop_.load(); });
+    }
+
+    // Blocking reads and opens inside libavformat poll this, stop() doesn't
+    // have to wait for a socket timeout
+    static int interrupt_input(void* opaque) {
+        return static_cast<VideoStreamer*>(opaque)->should_stop_.load(std::memory_order_relaxed);
+    }
 
     int v4l2_fd_ = -1;
     AVFormatContext* input_ctx_ = nullptr;
+    AVCodecContext* decoder_ctx_ = nullptr;
     AVCodecContext* encoder_ctx_ = nullptr;
-    AVFormatContext* output_ctx_ = nullptr;
+    std::vector<std::unique_ptr<Output>> sinks_;
+    std::atomic<uint64_t> encoded_packets_{0};  // or relayed, in pass-through mode
+
+    // RTSP (re)connect -> first frame out of the input stage. The start is set
+    // by the demux thread and taken by whichever thread delivers the frame.
+    std::atomic<int64_t> input_session_start_us_{0};
+
+    // UDP RTSP inputs
+    static constexpr int kMaxRtpPacketRate = 2000;       // ~20 Mbit/s of 1400 byte packets
+    static constexpr int kMinReorderPackets = 64;
+    static constexpr int kUdpReceiveBuffer = 4 * 1024 * 1024; // absorbs Wi-Fi bursts between reads
+    RtpInputStats rtp_stats_;
+    int64_t input_last_dts_ = AV_NOPTS_VALUE; // demux thread only
+    uint64_t input_reconnects_ = 0;
+    bool input_fast_started_ = false;
+    LatencyHistogram input_startup_;
+    BitrateController bitrate_controller_;
+    int64_t stats_since_us_ = 0;        // dump_stats only
+    uint64_t stats_since_packets_ = 0;
+    uint64_t stats_since_sensor_frames_ = 0;
     int video_stream_index_ = -1;
+
+    // Raw RTSP input, process thread only. Streams that don't announce a rate
+    // are timed as the ~18.8 fps camera they usually are.
     int64_t frame_count_ = 0;
+    int raw_picture_size_ = 0;
+    AVRational raw_frame_duration_ = {25, 469};
+
+    // Demux thread reconnects
+    static constexpr int64_t kInputStallUs = 5000000;
+    static constexpr milliseconds kInputRetryDelay{2};
+    static constexpr uint64_t kScrapeCheckDamaged = 20;
+    static constexpr milliseconds kMinReconnectBackoff{250};
+    static constexpr milliseconds kMaxReconnectBackoff{5000};
+
+    // Pass-through relay state, demux thread only. Timestamps are carried in
+    // relay_time_base_ and shifted by relay_offset_ so they stay monotonic
+    // across input reconnects.
+    bool passthrough_ = false;
+    AVRational relay_time_base_ = {1, 90000};
+    int64_t relay_offset_ = AV_NOPTS_VALUE;
+    int64_t relay_last_dts_ = AV_NOPTS_VALUE;
 
     int64_t last_pts_ = AV_NOPTS_VALUE;
 
-    AVFilterGraph* filter_graph_ = nullptr;
-    AVFilterContext* buffersrc_ctx_ = nullptr;
-    AVFilterContext* buffersink_ctx_ = nullptr;
+    // Rate conversion, used by whichever thread captures (reactor, RTSP capture or decode)
+    AVRational input_time_base_ = {1, 1};
+    FrameRateConverter rate_converter_;
 
     // V4L2 buffer info
+    // A dequeued buffer is loaned to the pipeline as an AVBufferRef; the last
+    // unref gives it back to the driver (VIDIOC_QBUF) instead of copying it.
+    enum V4L2BufferState {
+        V4L2_BUF_DRIVER,        // queued in the driver or idle
+        V4L2_BUF_LOANED,        // referenced by frames in the pipeline
+        V4L2_BUF_RELEASING,     // last reference dropped, being queued back (VIDIOC_QBUF)
+        V4L2_BUF_RETIRED        // loaned when the device was torn down, unmapped on release
+    };
     struct V4L2BufferInfo {
         void* start[VIDEO_MAX_PLANES] = {nullptr};
         size_t length[VIDEO_MAX_PLANES] = {0};
         int bytesperline[VIDEO_MAX_PLANES] = {0};
+        VideoStreamer* owner = nullptr;
+        unsigned int index = 0;
+        uint64_t generation = 0;    // v4l2_open_count_ of the device the buffer belongs to
+        std::atomic<int> state{V4L2_BUF_DRIVER};
     };
-    std::vector<V4L2BufferInfo> v4l2_buffers_;
+    std::vector<std::unique_ptr<V4L2BufferInfo>> v4l2_buffers_;
+    std::vector<std::unique_ptr<V4L2BufferInfo>> retired_v4l2_buffers_;
+    std::atomic<int> v4l2_loaned_{0};
+    std::atomic<bool> v4l2_streaming_{false};
+    std::atomic<bool> v4l2_requeue_failed_{false};
     int v4l2_width_ = 1280;
     int v4l2_height_ = 1024;
     AVPixelFormat v4l2_pix_fmt_ = AV_PIX_FMT_NV12;
 
-    struct FrameQueue {
-        std::queue<AVFrame*> queue;
-        std::mutex mtx;
-        std::condition_variable cond;
-        std::atomic<bool> quit{false};
+    FrameRing frame_queue_;
+    static constexpr size_t kFramePoolSlack = 8;
+    FramePool frame_pool_;
+    std::atomic<int> threads_running_{0};
+    std::thread capture_thread_;
+    std::thread process_thread_;
+    std::thread encode_thread_;
+
+    // RTSP input: demux -> process packets. A packet without data asks the
+    // decoder to drain and flush after an input reconnect. Raw pictures are
+    // large and independent, a short queue that drops when full does for them.
+    static constexpr size_t kPacketQueueDepth = 32;
+    static constexpr size_t kRawPacketQueueDepth = 4;
+    PacketQueue packet_queue_;
+    int64_t decode_pts_offset_ = AV_NOPTS_VALUE;  // process thread only, like relay_offset_
+    int64_t decode_last_pts_ = AV_NOPTS_VALUE;
+
+    // V4L2 capture state, only touched from the reactor thread
+    AVFrame* v4l2_frame_ = nullptr;
+    int v4l2_retry_count_ = 0;
+    bool v4l2_needs_reinit_ = false;
+    steady_clock::time_point v4l2_deadline_;
+    steady_clock::time_point v4l2_next_reinit_;
+    std::atomic<uint64_t> v4l2_open_count_{0};  // also read by release_v4l2_buffer
+    bool v4l2_on_reactor_ = false;
+    // Under the block policy: frames the queue had no room for. The reactor is
+    // shared, so instead of parking it the device stops being watched until
+    // these are queued.
+    std::deque<AVFrame*> v4l2_held_;
+    static constexpr AVRational kV4L2TimeBase = {1, 1000000};
+    int64_t v4l2_pts_origin_ = AV_NOPTS_VALUE;
+    int64_t v4l2_last_pts_ = AV_NOPTS_VALUE;
+    bool v4l2_warned_timestamp_ = false;
+
+    // Driver-side frame loss, from gaps in v4l2_buffer.sequence. "Starved" counts
+    // dequeues that left the driver without a free buffer, which is when it has
+    // to drop: sustained gaps while starved mean we need more buffers, gaps
+    // without starvation happen upstream (sensor/ISP) and more buffers won't help.
+    static constexpr int kMaxV4L2Buffers = 16;
+    static constexpr auto kDropWindow = 5s;
+    static constexpr uint64_t kDropPercent = 2;   // per window, to count as sustained
+    static constexpr int kSustainedWindows = 2;
+    std::atomic<int> v4l2_buffer_count_;         // req.count asked for, read by dump_stats
+    bool v4l2_have_sequence_ = false;
+    uint32_t v4l2_last_sequence_ = 0;
+    std::atomic<uint64_t> v4l2_sensor_frames_{0}; // frames the sensor produced, dropped ones included
+    std::atomic<uint64_t> v4l2_driver_drops_{0};
+    std::atomic<uint64_t> v4l2_starved_{0};
+    uint64_t window_frames_ = 0;
+    uint64_t window_drops_ = 0;
+    uint64_t window_starved_ = 0;
+    int sustained_drop_windows_ = 0;
+    steady_clock::time_point window_end_;
+
+    // Latency tracking. A frame carries an id in AVFrame::opaque (copied with
+    // every reference) that indexes its capture-side timestamps.
+    enum LatencyStage {
+        STAGE_SENSOR,       // V4L2 buffer timestamp -> dequeued, driver and ISP delay
+        STAGE_DECODE,       // av_read_frame -> decoded (or copied, raw inputs) frame out of the process thread
+        STAGE_TRANSFORM,    // rotate/mirror into a pooled frame
+        STAGE_CAPTURE,      // V4L2 dequeue / av_read_frame / decoded -> handed to the queue
+        STAGE_QUEUE,        // enqueued -> popped by the encoder
+        STAGE_ENCODE,       // avcodec_send_frame -> packet out
+        STAGE_COUNT         // send and end-to-end are tracked per output
+    };
+    LatencyHistogram latency_[STAGE_COUNT];
+
+    static constexpr size_t kStampSlots = 256;
+    // Room for a full frame queue plus the frames capture and encode still hold
+    static_assert(kStampSlots >= 2 * kMaxFrameQueueDepth, "frame stamps would wrap inside the queue");
+    struct FrameStamps {
+        int64_t origin_us = 0;      // sensor timestamp when the driver has one, else dequeue time
+        int64_t dequeue_us = 0;
+        int64_t enqueue_us = 0;
+    };
+    FrameStamps frame_stamps_[kStampSlots];
+    uint64_t next_frame_id_ = 0;
+
+    // Encoder side, maps packet pts back to the frame that produced it
+    static constexpr size_t kEncodeSlots = 64;
+    struct EncodeStamp {
+        int64_t pts = AV_NOPTS_VALUE;
+        int64_t origin_us = 0;
+        int64_t encode_in_us = 0;
+    };
+    EncodeStamp encode_stamps_[kEncodeSlots];
 
-        void push(AVFrame* frame) {
-            std::lock_guard<std::mutex> lock(mtx);
-            queue.push(frame);
-            cond.notify_one();
-        }
+    // Decoder side, maps frame pts back to the time its packet was read
+    static constexpr size_t kDecodeSlots = 64;
+    struct DecodeStamp {
+        int64_t pts = AV_NOPTS_VALUE;
+        int64_t read_us = 0;
+    };
+    DecodeStamp decode_stamps_[kDecodeSlots];
 
-        AVFrame* pop() {
-            std::unique_lock<std::mutex> lock(mtx);
-            while (queue.empty() && !quit) {
-                cond.wait(lock);
-            }
-            if (quit) return nullptr;
-            AVFrame* frame = queue.front();
-            queue.pop();
-            return frame;
-        }
+    static uint64_t frame_id(const AVFrame* frame) {
+        return reinterpret_cast<uintptr_t>(frame->opaque);
+    }
 
-        void wake_and_quit() {
-            quit = true;
-            cond.notify_all();
-        }
-    } frame_queue_;
+    FrameStamps& stamps_of(const AVFrame* frame) {
+        return frame_stamps_[frame_id(frame) % kStampSlots];
+    }
 
-    bool is_rtsp_source() const {
-        return config_.input_url.find("rtsp://") == 0;
+    // Called by capture right after a frame is dequeued
+    void stamp_captured(AVFrame* frame) {
+        uint64_t id = next_frame_id_++;
+        frame->opaque = reinterpret_cast<void*>(static_cast<uintptr_t>(id));
+        FrameStamps& stamps = frame_stamps_[id % kStampSlots];
+        stamps.dequeue_us = now_us();
+        stamps.origin_us = stamps.dequeue_us;
+        stamps.enqueue_us = 0;
+    }
+
+    // Rate converter duplicates share the source's frame id. One that was
+    // already queued gets a slot of its own, so its enqueue time doesn't
+    // overwrite the stamp of a copy still waiting in the queue.
+    void stamp_duplicate(AVFrame* frame) {
+        if (!stamps_of(frame).enqueue_us) return;
+        FrameStamps copy = stamps_of(frame);
+        uint64_t id = next_frame_id_++;
+        frame->opaque = reinterpret_cast<void*>(static_cast<uintptr_t>(id));
+        FrameStamps& stamps = frame_stamps_[id % kStampSlots];
+        stamps = copy;
+        stamps.enqueue_us = 0;
     }
 
+    void stamp_handoff(const AVFrame* frame) {
+        latency_[STAGE_CAPTURE].record(now_us() - stamps_of(frame).dequeue_us);
+    }
+    std::atomic<uint64_t> dropped_frames_{0};
+    steady_clock::time_point last_drop_log_;
+
     int init_v4l2_device() {
         // Parse video size
         size_t delimiter = config_.video_size.find('x');
@@ -248,6 +3932,7 @@ private:
 
         // Open the V4L2 device
         v4l2_fd_ = open(config_.input_url.c_str(), O_RDWR | O_NONBLOCK);
+        v4l2_open_count_++;
         if (v4l2_fd_ < 0) {
             g_logger.log(LOG_ERROR, "Failed to open V4L2 device: " + std::string(strerror(errno)));
             return -1;
@@ -305,7 +3990,7 @@ private:
     int init_v4l2_buffers() {
         // Request buffers
         struct v4l2_requestbuffers req = {};
-        req.count = 4;
+        req.count = v4l2_buffer_count_;
         req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
         req.memory = V4L2_MEMORY_MMAP;
 
@@ -314,7 +3999,19 @@ private:
             return -1;
         }
 
-        v4l2_buffers_.resize(req.count);
+        if (static_cast<int>(req.count) != v4l2_buffer_count_) {
+            LOGF(LOG_INFO, "Driver granted ", req.count, " of ", v4l2_buffer_count_.load(), " requested V4L2 buffers");
+        }
+        // A new stream restarts the sequence numbers
+        v4l2_have_sequence_ = false;
+
+        v4l2_buffers_.clear();
+        for (unsigned int i = 0; i < req.count; ++i) {
+            v4l2_buffers_.emplace_back(new V4L2BufferInfo());
+            v4l2_buffers_[i]->owner = this;
+            v4l2_buffers_[i]->index = i;
+            v4l2_buffers_[i]->generation = v4l2_open_count_;
+        }
 
         int bytesperlinei[VIDEO_MAX_PLANES] = {0};
 	    struct v4l2_format fmt2 = {0};
@@ -349,17 +4046,18 @@ private:
             for (int j = 0; j < VIDEO_MAX_PLANES; j++) {
                 if (planes[j].length == 0) break;
 
-                v4l2_buffers_[i].start[j] = mmap(NULL, planes[j].length,
+                v4l2_buffers_[i]->start[j] = mmap(NULL, planes[j].length,
                                                PROT_READ | PROT_WRITE, MAP_SHARED,
                                                v4l2_fd_, planes[j].m.mem_offset);
-                if (v4l2_buffers_[i].start[j] == MAP_FAILED) {
+                if (v4l2_buffers_[i]->start[j] == MAP_FAILED) {
+                    v4l2_buffers_[i]->start[j] = nullptr;
                     g_logger.log(LOG_ERROR, "Failed to mmap V4L2 buffer: " + std::string(strerror(errno)));
                     return -1;
                 }
-                v4l2_buffers_[i].length[j] = planes[j].length;
-                //v4l2_buffers_[i].bytesperline[j] = planes[j].bytesperline;
-                //v4l2_buffers_[i].bytesperline[j] = 1280; //tbc 
-                v4l2_buffers_[i].bytesperline[j] = bytesperlinei[j]; 
+                v4l2_buffers_[i]->length[j] = planes[j].length;
+                //v4l2_buffers_[i]->bytesperline[j] = planes[j].bytesperline;
+                //v4l2_buffers_[i]->bytesperline[j] = 1280; //tbc 
+                v4l2_buffers_[i]->bytesperline[j] = bytesperlinei[j]; 
             }
 
             // Queue the buffer
@@ -375,69 +4073,120 @@ private:
             g_logger.log(LOG_ERROR, "Failed to start V4L2 streaming: " + std::string(strerror(errno)));
             return -1;
         }
+        v4l2_streaming_ = true;
+        v4l2_requeue_failed_ = false;
 
         g_logger.log(LOG_INFO, "V4L2 buffers initialized successfully");
         return 0;
     }
 
+    static void unmap_v4l2_buffer(V4L2BufferInfo& buf) {
+        for (int j = 0; j < VIDEO_MAX_PLANES; j++) {
+            if (buf.start[j]) {
+                munmap(buf.start[j], buf.length[j]);
+                buf.start[j] = nullptr;
+            }
+        }
+    }
+
     void cleanup_v4l2_buffers() {
         if (v4l2_fd_ < 0) return;
 
         // Stop streaming
+        v4l2_streaming_ = false;
         enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
         ioctl(v4l2_fd_, VIDIOC_STREAMOFF, &type);
 
-        // Unmap buffers
+        // Unmap buffers; the ones still referenced by frames are unmapped by
+        // their release callback once the encoder lets go of them. A release
+        // already past that point is requeueing on v4l2_fd_, which the caller
+        // is about to close, so wait for it to finish.
+        int retired = 0;
         for (auto& buf : v4l2_buffers_) {
-            for (int j = 0; j < VIDEO_MAX_PLANES; j++) {
-                if (buf.start[j]) {
-                    munmap(buf.start[j], buf.length[j]);
-                    buf.start[j] = nullptr;
-                }
+            int expected = V4L2_BUF_LOANED;
+            if (buf->state.compare_exchange_strong(expected, V4L2_BUF_RETIRED)) {
+                retired_v4l2_buffers_.push_back(std::move(buf));
+                retired++;
+                continue;
             }
+            while (buf->state.load(std::memory_order_acquire) == V4L2_BUF_RELEASING) {
+                std::this_thread::yield();
+            }
+            unmap_v4l2_buffer(*buf);
         }
         v4l2_buffers_.clear();
+
+        if (retired > 0) {
+            g_logger.log(LOG_WARNING, "V4L2 buffers still loaned at teardown: " + std::to_string(retired));
+        }
     }
 
-    int init_input() {
-        if (is_rtsp_source()) {
-            // Keep the original RTSP initialization
-            input_ctx_ = avformat_alloc_context();
-            if (!input_ctx_) {
-                g_logger.log(LOG_ERROR, "Failed to allocate input context");
-                return AVERROR(ENOMEM);
-            }
-            
-            AVDictionary* options = nullptr;
-            av_dict_set(&options, "rtsp_transport", "tcp", 0);
-            av_dict_set(&options, "stimeout", "5000000", 0); 
+    // AVBuffer free callback, runs on whichever thread drops the last reference
+    static void release_v4l2_buffer(void* opaque, uint8_t* data) {
+        (void)data;
+        V4L2BufferInfo* info = static_cast<V4L2BufferInfo*>(opaque);
+        VideoStreamer* self = info->owner;
+
+        int expected = V4L2_BUF_LOANED;
+        if (!info->state.compare_exchange_strong(expected, V4L2_BUF_RELEASING)) {
+            // Device was reinitialized while this buffer was out
+            unmap_v4l2_buffer(*info);
+            self->v4l2_loaned_--;
+            return;
+        }
+        self->v4l2_loaned_--;
 
-            int ret = avformat_open_input(&input_ctx_, config_.input_url.c_str(), nullptr, &options);
-            if (ret < 0) {
-                ERROR_STR(ret);
-                g_logger.log(LOG_ERROR, std::string("Failed to open input ") + config_.input_url + ": " + errbuf);
-                av_dict_free(&options);
-                return false;
-            }
+        // While RELEASING, cleanup_v4l2_buffers waits and info and the fd stay valid
+        if (self->v4l2_streaming_ && info->generation == self->v4l2_open_count_) {
+            requeue_v4l2_buffer(self, info->index);
+        }
+        info->state.store(V4L2_BUF_DRIVER, std::memory_order_release);
+    }
 
-            ret = avformat_find_stream_info(input_ctx_, nullptr);
-            if (ret < 0) {
-                ERROR_STR(ret);
-                g_logger.log(LOG_ERROR, std::string("Failed to find stream info: ") + errbuf);
-                return false;
-            }
+    static void requeue_v4l2_buffer(VideoStreamer* self, unsigned int index) {
+        struct v4l2_buffer buf = {};
+        struct v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = index;
+        buf.length = VIDEO_MAX_PLANES;
+        buf.m.planes = planes;
+
+        if (ioctl(self->v4l2_fd_, VIDIOC_QBUF, &buf) < 0) {
+            LOGF(LOG_ERROR, "Failed to requeue V4L2 buffer: ", strerror(errno));
+            self->v4l2_requeue_failed_ = true;
+        }
+    }
 
-            for (unsigned i = 0; i < input_ctx_->nb_streams; i++) {
-                if (input_ctx_->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-                    video_stream_index_ = i;
-                    AVPixelFormat input_fmt = static_cast<AVPixelFormat>(input_ctx_->streams[i]->codecpar->format);
-                    g_logger.log(LOG_INFO, std::string("Input source: ") + config_.input_url + 
-                             " | Format: " + av_get_pix_fmt_name(input_fmt) +
-                             " | Resolution: " + config_.video_size +
-                             " | video_stream_index_: " + std::to_string(video_stream_index_));
-                    break;
-                }
+    // Wrap a dequeued V4L2 buffer so it travels through the pipeline by reference
+    AVBufferRef* loan_v4l2_buffer(unsigned int index) {
+        V4L2BufferInfo* info = v4l2_buffers_[index].get();
+        AVBufferRef* ref = av_buffer_create(static_cast<uint8_t*>(info->start[0]), info->length[0],
+                                            release_v4l2_buffer, info, AV_BUFFER_FLAG_READONLY);
+        if (!ref) return nullptr;
+
+        info->state = V4L2_BUF_LOANED;
+        v4l2_loaned_++;
+        return ref;
+    }
+
+    int init_input() {
+        if (is_rtsp_source()) {
+            int64_t open_start = now_us();
+            StreamParamCache::Entry cached;
+            bool fast = config_.fast_start && g_stream_params.find(config_.input_url, cached);
+            if (fast && !open_rtsp_input(&cached)) {
+                g_logger.log(LOG_INFO, "Cached stream parameters don't match " + config_.input_url +
+                          " anymore, probing in full");
+                fast = false;
+            }
+            if (!fast && !open_rtsp_input(nullptr)) return false;
+            if (config_.fast_start) {
+                g_stream_params.store(config_.input_url, input_ctx_->streams[video_stream_index_]);
             }
+            LOGF(LOG_INFO, "Input opened in ", (now_us() - open_start) / 1000, " ms (",
+                 fast ? "fast start" : "full probe", ")");
+            input_fast_started_ = fast;
         } else {
             // Initialize V4L2 MPlane device
             if (init_v4l2_device() < 0) {
@@ -446,6 +4195,7 @@ private:
             
             // Initialize V4L2 buffers
             if (init_v4l2_buffers() < 0) {
+                cleanup_v4l2_buffers();
                 close(v4l2_fd_);
                 v4l2_fd_ = -1;
                 return false;
@@ -462,101 +4212,145 @@ private:
         return true;
     }
 
-    int init_framerate_filter() {
-        AVRational time_base;
-        
-        if (is_rtsp_source()) {
-            AVStream* stream = input_ctx_->streams[video_stream_index_];
-            time_base = stream->time_base;
-        } else {
-            time_base = (AVRational){1, static_cast<int>(config_.input_fps)};
+    // Opens the RTSP input. With cached parameters the probe reads only what it
+    // must and the cache fills in the rest; false if the probe contradicts
+    // them, the input is closed again then.
+    bool open_rtsp_input(const StreamParamCache::Entry* cached) {
+        input_ctx_ = avformat_alloc_context();
+        if (!input_ctx_) {
+            g_logger.log(LOG_ERROR, "Failed to allocate input context");
+            return false;
+        }
+        input_ctx_->interrupt_callback = {interrupt_input, this};
+        if (cached) {
+            input_ctx_->probesize = 32;
+            input_ctx_->max_analyze_duration = 0;
+            input_ctx_->fps_probe_size = 0;
         }
 
-        const AVFilter* buffersrc = avfilter_get_by_name("buffer");
-        const AVFilter* buffersink = avfilter_get_by_name("buffersink");
-        filter_graph_ = avfilter_graph_alloc();
+        AVDictionary* options = nullptr;
+        if (config_.rtsp_udp) {
+            // A lost datagram costs its frame instead of stalling everything behind
+            // a TCP retransmission. rtpdec holds later packets back for at most
+            // jitter_ms waiting for a gap to fill, the queue is sized to cover that
+            // window at kMaxRtpPacketRate.
+            input_ctx_->opaque = &rtp_stats_;
+            av_dict_set(&options, "rtsp_transport", "udp", 0);
+            av_dict_set(&options, "max_delay", std::to_string(config_.jitter_ms * 1000).c_str(), 0);
+            av_dict_set(&options, "reorder_queue_size",
+                        std::to_string(std::max(kMinReorderPackets, config_.jitter_ms * kMaxRtpPacketRate / 1000)).c_str(), 0);
+            av_dict_set(&options, "buffer_size", std::to_string(kUdpReceiveBuffer).c_str(), 0);
+        } else {
+            av_dict_set(&options, "rtsp_transport", "tcp", 0);
+        }
+        av_dict_set(&options, "stimeout", "5000000", 0);
 
-        AVRational sar = (AVRational){1, 1}; // default square pixels
-        g_logger.log(LOG_INFO, std::to_string(sar.num) + "/" + std::to_string(sar.den));
-        
-        std::string args = "video_size=" + std::to_string(v4l2_width_) + "x" + 
-                          std::to_string(v4l2_height_) + 
-                          ":pix_fmt=" + std::to_string(v4l2_pix_fmt_) + 
-                          ":time_base=" + std::to_string(time_base.num) + "/" + 
-                          std::to_string(time_base.den) +  
-                          ":pixel_aspect=" + std::to_string(sar.num) + "/" + 
-                          std::to_string(sar.den);
-
-        int ret = avfilter_graph_create_filter(&buffersrc_ctx_, buffersrc, "in", 
-                                             args.c_str(), nullptr, filter_graph_);
+        int ret = avformat_open_input(&input_ctx_, config_.input_url.c_str(), nullptr, &options);
+        av_dict_free(&options);
         if (ret < 0) {
             ERROR_STR(ret);
-            g_logger.log(LOG_ERROR, "Failed to create buffer source");
-            return ret;
+            g_logger.log(LOG_ERROR, std::string("Failed to open input ") + config_.input_url + ": " + errbuf);
+            return false;
         }
 
-        ret = avfilter_graph_create_filter(&buffersink_ctx_, buffersink, "out", 
-                                         nullptr, nullptr, filter_graph_);
+        ret = avformat_find_stream_info(input_ctx_, nullptr);
         if (ret < 0) {
             ERROR_STR(ret);
-            g_logger.log(LOG_ERROR, "Failed to create buffer sink");
-            return ret;
+            g_logger.log(LOG_ERROR, std::string("Failed to find stream info: ") + errbuf);
+            avformat_close_input(&input_ctx_);
+            return false;
         }
 
-        AVFilterContext* fps_ctx;
-        const AVFilter* fps_filter = avfilter_get_by_name("fps");
-        std::string fps_args = "fps=" + std::to_string(config_.output_fps);
-
-        ret = avfilter_graph_create_filter(&fps_ctx, fps_filter, "fps", 
-                                         fps_args.c_str(), nullptr, filter_graph_);
-        if (ret < 0) {
-            ERROR_STR(ret);
-            g_logger.log(LOG_ERROR, "Failed to create fps filter");
-            return ret;
+        video_stream_index_ = -1;
+        for (unsigned i = 0; i < input_ctx_->nb_streams; i++) {
+            if (input_ctx_->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+                video_stream_index_ = i;
+                break;
+            }
+        }
+        if (video_stream_index_ < 0) {
+            g_logger.log(LOG_ERROR, "No video stream in " + config_.input_url);
+            avformat_close_input(&input_ctx_);
+            return false;
         }
 
-        AVFilterContext* hflip_ctx;
-        const AVFilter* hflip_filter = avfilter_get_by_name("hflip");
-        ret = avfilter_graph_create_filter(&hflip_ctx, hflip_filter, "hflip", nullptr, nullptr, filter_graph_);
-        if (ret < 0) {
-            ERROR_STR(ret);
-            g_logger.log(LOG_ERROR, "Failed to create hflip filter");
-            return ret;
+        AVStream* stream = input_ctx_->streams[video_stream_index_];
+        if (cached && (!StreamParamCache::matches(*cached, stream->codecpar) ||
+                       !StreamParamCache::fill(*cached, stream))) {
+            avformat_close_input(&input_ctx_);
+            return false;
         }
 
-        ret = avfilter_link(buffersrc_ctx_, 0, fps_ctx, 0);
-        if (ret < 0) {
-            ERROR_STR(ret);
-            g_logger.log(LOG_ERROR, "Failed to link filters src to fps");
-            return ret;
+        const AVCodecParameters* par = stream->codecpar;
+        // Compressed streams have no pixel format, name the codec instead
+        const char* format_name = par->codec_id == AV_CODEC_ID_RAWVIDEO ?
+            av_get_pix_fmt_name(static_cast<AVPixelFormat>(par->format)) : avcodec_get_name(par->codec_id);
+        g_logger.log(LOG_INFO, std::string("Input source: ") + config_.input_url +
+                 " | Format: " + (format_name ? format_name : "unknown") +
+                 " | Resolution: " + std::to_string(par->width) + "x" + std::to_string(par->height) +
+                 " | video_stream_index_: " + std::to_string(video_stream_index_));
+        return true;
+    }
+
+    // Called with the first frame (or relayed packet) of an input session
+    void on_input_first_frame() {
+        int64_t since = input_session_start_us_.exchange(0, std::memory_order_relaxed);
+        if (!since) return;
+        int64_t elapsed = now_us() - since;
+        input_startup_.record(elapsed);
+        LOGF(LOG_INFO, "First frame from ", config_.input_url, " ", elapsed / 1000, " ms after ",
+             input_reconnects_ ? "reconnecting" : "starting", input_fast_started_ ? " (fast start)" : "");
+    }
+
+    int init_decoder() {
+        AVStream* stream = input_ctx_->streams[video_stream_index_];
+        const AVCodec* codec = avcodec_find_decoder(stream->codecpar->codec_id);
+        if (!codec) {
+            g_logger.log(LOG_ERROR, std::string("No decoder for ") + avcodec_get_name(stream->codecpar->codec_id));
+            return AVERROR(ENOSYS);
         }
 
-        ret = avfilter_link(fps_ctx, 0, hflip_ctx, 0);
-        if (ret < 0) {
-            ERROR_STR(ret);
-            g_logger.log(LOG_ERROR, "Failed to link filters fps to hflip");
-            return ret;
+        decoder_ctx_ = avcodec_alloc_context3(codec);
+        if (!decoder_ctx_) {
+            g_logger.log(LOG_ERROR, "Failed to allocate decoder context");
+            return AVERROR(ENOMEM);
         }
 
-        ret = avfilter_link(hflip_ctx, 0, buffersink_ctx_, 0);
+        int ret = avcodec_parameters_to_context(decoder_ctx_, stream->codecpar);
         if (ret < 0) {
             ERROR_STR(ret);
-            g_logger.log(LOG_ERROR, "Failed to link filters hflip to sink");
+            g_logger.log(LOG_ERROR, std::string("Failed to copy decoder parameters: ") + errbuf);
             return ret;
         }
+        decoder_ctx_->pkt_timebase = stream->time_base;
+        // Frame threads carry the bitrate, slice threads keep single frames fast
+        decoder_ctx_->thread_count = config_.decode_threads;
+        decoder_ctx_->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
 
-        ret = avfilter_graph_config(filter_graph_, nullptr);
+        ret = avcodec_open2(decoder_ctx_, codec, nullptr);
         if (ret < 0) {
             ERROR_STR(ret);
-            g_logger.log(LOG_ERROR, "Failed to configure filter graph");
+            g_logger.log(LOG_ERROR, std::string("Failed to open decoder: ") + errbuf);
             return ret;
         }
 
-        g_logger.log(LOG_INFO, std::string("Framerate filter initialized (") + 
-                  std::to_string(config_.input_fps) + "->" + std::to_string(config_.output_fps) + "fps)");
+        // Decoded frames feed the encoder, size them from the stream
+        v4l2_width_ = decoder_ctx_->width;
+        v4l2_height_ = decoder_ctx_->height;
+        v4l2_pix_fmt_ = decoded_format(decoder_ctx_->pix_fmt);
+
+        g_logger.log(LOG_INFO, std::string("Decoder ") + codec->name + " initialized, " +
+                  std::to_string(v4l2_width_) + "x" + std::to_string(v4l2_height_) +
+                  ", threads: " + std::to_string(decoder_ctx_->thread_count));
         return 0;
     }
 
+    // Full-range YUV is laid out like plain YUV420P, which the encoder takes
+    static AVPixelFormat decoded_format(AVPixelFormat fmt) {
+        if (fmt == AV_PIX_FMT_YUVJ420P || fmt == AV_PIX_FMT_NONE) return AV_PIX_FMT_YUV420P;
+        return fmt;
+    }
+
     int init_encoder() {
         const AVCodec* codec = avcodec_find_encoder_by_name("h264_rkmpp");
         if (!codec) {
@@ -570,13 +4364,16 @@ private:
             return AVERROR(ENOMEM);
         }
 
-        encoder_ctx_->width = v4l2_width_;
-        encoder_ctx_->height = v4l2_height_;
+        encoder_ctx_->width = out_width();
+        encoder_ctx_->height = out_height();
         encoder_ctx_->time_base = {1, config_.output_fps};
         encoder_ctx_->framerate = {config_.output_fps, 1};
         encoder_ctx_->pix_fmt = v4l2_pix_fmt_;
         encoder_ctx_->gop_size = config_.output_fps;
         encoder_ctx_->max_b_frames = 0;
+        encoder_ctx_->bit_rate = config_.bitrate;
+        encoder_ctx_->rc_max_rate = config_.bitrate;
+        encoder_ctx_->rc_buffer_size = config_.bitrate;
         av_opt_set(encoder_ctx_->priv_data, "preset", "fast", 0);
         av_opt_set(encoder_ctx_->priv_data, "tune", "zerolatency", 0);
 
@@ -587,346 +4384,736 @@ private:
             return ret;
         }
 
+        if (config_.min_bitrate > 0) {
+            bitrate_controller_.init(std::min(config_.min_bitrate, config_.bitrate), config_.bitrate, config_.output_fps);
+            LOGF(LOG_INFO, "Adaptive bitrate between ", config_.min_bitrate / 1000, " and ",
+                 config_.bitrate / 1000, " kbps");
+        }
+
         g_logger.log(LOG_INFO, "Encoder initialized successfully");
         return 0;
     }
 
-    bool init_output() {
-        int ret = avformat_alloc_output_context2(&output_ctx_, nullptr, "rtsp", config_.output_url.c_str());
-        if (!output_ctx_) {
-            g_logger.log(LOG_ERROR, "Failed to create output context");
-            return false;
+    // Runs on the encode thread between frames. The rate control of h264_rkmpp
+    // (and libx264) picks up bit_rate/rc_max_rate changes on the next frame,
+    // no reopen and no forced IDR.
+    void adapt_bitrate() {
+        if (config_.min_bitrate <= 0 || !bitrate_controller_.due(now_us())) return;
+
+        size_t queued = 0;
+        int64_t write_us = 0;
+        for (auto& sink : sinks_) {
+            Output::Load load = sink->take_load();
+            // A disconnected output drains its queue and isn't the link's fault
+            if (!load.connected) continue;
+            queued = std::max(queued, load.peak_queued);
+            write_us = std::max(write_us, load.mean_write_us);
         }
+        if (!bitrate_controller_.update(queued, write_us)) return;
 
-        AVStream* stream = avformat_new_stream(output_ctx_, nullptr);
-        if (!stream) {
-            g_logger.log(LOG_ERROR, "Failed to create output stream");
+        int64_t bitrate = bitrate_controller_.bitrate();
+        encoder_ctx_->bit_rate = bitrate;
+        encoder_ctx_->rc_max_rate = bitrate;
+        LOGF(LOG_INFO, "Output load queued=", queued, " write=", write_us, "us, now ",
+             bitrate / 1000, " kbps at ", bitrate_controller_.fps(), " fps");
+    }
+
+    // Pass-through needs an RTSP input whose video is already H.264, the
+    // codec every output of this streamer expects.
+    bool can_passthrough() const {
+        if (!is_rtsp_source() || video_stream_index_ < 0) {
+            g_logger.log(LOG_WARNING, "Pass-through needs an RTSP input, transcoding " + config_.input_url);
+            return false;
+        }
+        const AVCodecParameters* par = input_ctx_->streams[video_stream_index_]->codecpar;
+        if (par->codec_id != AV_CODEC_ID_H264) {
+            g_logger.log(LOG_WARNING, std::string("Input codec ") + avcodec_get_name(par->codec_id) +
+                      " can't be relayed as H.264, transcoding " + config_.input_url);
             return false;
         }
+        if (config_.convert_rate) {
+            g_logger.log(LOG_INFO, "Pass-through relays the input frame rate, rate conversion is not used");
+        }
+        if (config_.hflip) {
+            g_logger.log(LOG_WARNING, "Pass-through relays the picture as sent, " + config_.input_url +
+                      " is not mirrored (--no-hflip silences this)");
+        }
+        g_logger.log(LOG_INFO, "Pass-through: remuxing " + config_.input_url + " without transcoding");
+        return true;
+    }
+
+    // output_url may list several outputs separated by '|', all fed from one
+    // encoder, or from the input stream itself in pass-through mode
+    int init_outputs() {
+        AVCodecParameters* codecpar = avcodec_parameters_alloc();
+        if (!codecpar) return AVERROR(ENOMEM);
+        AVRational time_base;
+        if (passthrough_) {
+            const AVStream* stream = input_ctx_->streams[video_stream_index_];
+            avcodec_parameters_copy(codecpar, stream->codecpar);
+            relay_time_base_ = stream->time_base;
+            time_base = relay_time_base_;
+        } else {
+            avcodec_parameters_from_context(codecpar, encoder_ctx_);
+            time_base = encoder_ctx_->time_base;
+        }
 
-        avcodec_parameters_from_context(stream->codecpar, encoder_ctx_);
-        stream->time_base = encoder_ctx_->time_base;
+        for (const std::string& url : split_list(config_.output_url, '|')) {
+            if (url.empty()) continue;
+            std::unique_ptr<Output> sink;
+            if (url.find("rtsp-server://") == 0) {
+                sink.reset(new RtspServer(url, config_.sink_queue_depth));
+            } else if (url.find("rtp://") == 0) {
+                sink.reset(new RtpSink(url, config_.sink_queue_depth));
+            } else if (url.find("hls://") == 0) {
+                sink.reset(new HlsSink(url, config_.sink_queue_depth));
+            } else {
+                sink.reset(new PacketSink(url, config_.sink_queue_depth));
+            }
+            if (!sink->configure(codecpar, time_base)) {
+                avcodec_parameters_free(&codecpar);
+                return -1;
+            }
+            sinks_.push_back(std::move(sink));
+        }
+        avcodec_parameters_free(&codecpar);
 
-        if (!(output_ctx_->oformat->flags & AVFMT_NOFILE)) {
-            ret = avio_open(&output_ctx_->pb, output_ctx_->url, AVIO_FLAG_WRITE);
-            if (ret < 0) {
-                ERROR_STR(ret);
-                g_logger.log(LOG_ERROR, std::string("Failed to open output IO: ") + errbuf);
-                return false;
+        g_logger.log(LOG_INFO, "Outputs configured: " + std::to_string(sinks_.size()));
+        return 0;
+    }
+
+    // Damage and ordering as the demuxer hands packets over, after its jitter buffer
+    void track_input_packet(const AVPacket* packet) {
+        if (packet->flags & AV_PKT_FLAG_CORRUPT) {
+            uint64_t damaged = ++rtp_stats_.damaged;
+            // Damage without a single scraped loss means this FFmpeg words its
+            // RTP warnings differently; say so once instead of reporting lost=0
+            if (config_.rtsp_udp && damaged >= kScrapeCheckDamaged && !rtp_stats_.scrape_warned &&
+                rtp_stats_.lost == 0 && rtp_stats_.late == 0) {
+                rtp_stats_.scrape_warned = true;
+                LOGF(LOG_WARNING, "Input ", config_.input_url, ": ", damaged,
+                     " damaged frames but no RTP loss messages matched; lost/late counters are unreliable with this FFmpeg");
             }
         }
+        if (packet->dts == AV_NOPTS_VALUE) return;
+        if (input_last_dts_ != AV_NOPTS_VALUE && packet->dts <= input_last_dts_) {
+            rtp_stats_.out_of_order++;
+            return;
+        }
+        input_last_dts_ = packet->dts;
+    }
 
-        ret = avformat_write_header(output_ctx_, nullptr);
-        if (ret < 0) {
-            ERROR_STR(ret);
-            g_logger.log(LOG_ERROR, std::string("Failed to write header: ") + errbuf);
-            return false;
+    // Resets the timestamp continuity of the relay and the decoder after a new input session
+    void on_input_reconnected() {
+        relay_offset_ = AV_NOPTS_VALUE;
+        input_last_dts_ = AV_NOPTS_VALUE;
+        if (decoder_ctx_) {
+            AVPacket* flush = av_packet_alloc();
+            if (flush && !packet_queue_.push_wait(flush)) av_packet_free(&flush);
         }
+    }
 
-        g_logger.log(LOG_INFO, std::string("Output initialized to ") + config_.output_url);
+    bool transforms_picture() const { return config_.hflip || config_.rotation != 0; }
+
+    // Picture size after rotation, what the encoder sees
+    int out_width() const { return config_.rotation % 180 ? v4l2_height_ : v4l2_width_; }
+    int out_height() const { return config_.rotation % 180 ? v4l2_width_ : v4l2_height_; }
+
+    // Applies the configured picture transform, writing into a pooled frame.
+    // The source reference is released right away, for V4L2 that returns the
+    // buffer to the driver before the frame even reaches the queue.
+    bool transform_frame(AVFrame* frame) {
+        if (!transforms_picture()) return true;
+
+        int64_t start_us = now_us();
+        AVFrame* out = frame_pool_.get_buffered();
+        if (!out) {
+            g_logger.log(LOG_ERROR, "Failed to get a frame from the pool");
+            return false;
+        }
+        transform_picture(out->data, out->linesize, frame->data, frame->linesize,
+                          v4l2_pix_fmt_, v4l2_width_, v4l2_height_, config_.rotation, config_.hflip);
+        av_frame_copy_props(out, frame);
+        av_frame_unref(frame);
+        av_frame_move_ref(frame, out);
+        frame_pool_.put(out);
+        latency_[STAGE_TRANSFORM].record(now_us() - start_us);
         return true;
     }
 
-    void capture_loop() {
-        if (is_rtsp_source()) {
-            capture_loop_rtsp();
-        } else {
-            capture_loop_v4l2();
+    // Hands a captured or decoded frame to the encoder queue, through the rate
+    // converter when enabled. Moves the frame's references out, the caller is
+    // left with an empty frame.
+    void deliver_frame(AVFrame* frame) {
+        stamp_handoff(frame);
+        on_input_first_frame();
+        if (config_.convert_rate) {
+            rate_converter_.push(frame, [this](AVFrame* src, int64_t pts) {
+                AVFrame* out = frame_pool_.get();
+                if (!out) return;
+                // Duplicates share the pixels, only the reference is new
+                if (av_frame_ref(out, src) < 0) {
+                    frame_pool_.put(out);
+                    return;
+                }
+                out->pts = pts;
+                stamp_duplicate(out);
+                enqueue_frame(out);
+            });
+            return;
+        }
+
+        AVFrame* new_frame = frame_pool_.get();
+        if (!new_frame) {
+            g_logger.log(LOG_ERROR, "Failed to get a frame from the pool");
+            av_frame_unref(frame);
+            return;
+        }
+        av_frame_move_ref(new_frame, frame);
+        new_frame->pts = av_rescale_q(new_frame->pts, input_time_base_, encoder_ctx_->time_base);
+        enqueue_frame(new_frame);
+    }
+
+    // Pass-through: hands the demuxed packet to every output as is
+    void relay_packet(AVPacket* packet) {
+        const AVStream* stream = input_ctx_->streams[video_stream_index_];
+        if (packet->dts == AV_NOPTS_VALUE) packet->dts = packet->pts;
+        if (packet->pts == AV_NOPTS_VALUE) packet->pts = packet->dts;
+        if (packet->dts == AV_NOPTS_VALUE) return;
+
+        av_packet_rescale_ts(packet, stream->time_base, relay_time_base_);
+
+        // After a reconnect the input clock restarts, continue right after the last packet sent
+        if (relay_offset_ == AV_NOPTS_VALUE) {
+            relay_offset_ = relay_last_dts_ == AV_NOPTS_VALUE ? 0 : relay_last_dts_ + 1 - packet->dts;
+        }
+        packet->pts += relay_offset_;
+        packet->dts += relay_offset_;
+        if (relay_last_dts_ != AV_NOPTS_VALUE && packet->dts <= relay_last_dts_) {
+            LOGF(LOG_DEBUG, "Dropping non-monotonic relay packet DTS: ", packet->dts);
+            return;
         }
+        relay_last_dts_ = packet->dts;
+
+        packet->stream_index = 0;
+        packet->opaque = reinterpret_cast<void*>(static_cast<intptr_t>(now_us()));
+        on_input_first_frame();
+        for (auto& sink : sinks_) {
+            sink->send(packet);
+        }
+        encoded_packets_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Closes the input and opens it again, backing off between attempts.
+    // False when stopped meanwhile.
+    bool reconnect_input() {
+        input_session_start_us_ = now_us();
+        input_reconnects_++;
+        avformat_close_input(&input_ctx_);
+        milliseconds backoff = kMinReconnectBackoff;
+        while (!init_input()) {
+            if (should_stop_) return false;
+            LOGF(LOG_WARNING, "Reopening ", config_.input_url, " failed, retrying in ", backoff.count(), " ms");
+            if (wait_for_stop(backoff)) return false;
+            backoff = std::min(backoff * 2, kMaxReconnectBackoff);
+        }
+        on_input_reconnected();
+        return true;
     }
 
+    // Demux thread. It only reads: packets go to the process thread over
+    // packet_queue_, so decoding or copying a picture never delays the next
+    // read and the socket buffer keeps draining. av_read_frame blocks in
+    // libavformat's poll() until data arrives, the socket timeout expires
+    // (stimeout) or stop() trips the interrupt callback.
     void capture_loop_rtsp() {
+        ThreadScope scope("capture", config_.input_url);
         AVPacket* packet = av_packet_alloc();
-        AVFrame* frame = av_frame_alloc();
-        AVFrame* filtered_frame = av_frame_alloc();
+        int64_t stalled_since = 0;
 
-        static int64_t ii=0;
-        static int64_t retry_num=0;
-
-        g_logger.log(LOG_INFO, "Capture thread started (RTSP)");
+        g_logger.log(LOG_INFO, "Demux thread started (RTSP)");
 
         while (!should_stop_) {
-            auto capture_start = high_resolution_clock::now();
+            int ret = av_read_frame(input_ctx_, packet);
+            if (ret == AVERROR_EXIT && should_stop_) break;
 
-            if (input_ctx_->pb && input_ctx_->pb->error) {
-               g_logger.log(LOG_ERROR, "I/O error detected, retry?");
+            // Only non-blocking demuxers return EAGAIN, a stream that keeps
+            // returning it without data for kInputStall is dead all the same.
+            // Back off before retrying: spinning here would starve everything
+            // else on the core, more so with --sched capture=fifo.
+            if (ret == AVERROR(EAGAIN)) {
+                int64_t now = now_us();
+                if (!stalled_since) stalled_since = now;
+                if (now - stalled_since < kInputStallUs) {
+                    std::this_thread::sleep_for(kInputRetryDelay);
+                    continue;
+                }
             }
-
-            retry_num++;
-            int ret = av_read_frame(input_ctx_, packet);
-            ii++; 
-            if (ii%15 == 0)
-            {
-                //std::cout << "ERROR in av read frame ret=" << ret << "ii=" <<ii <<std::endl;
+            if (ret < 0) {
+                ERROR_STR(ret);
+                LOGF(LOG_ERROR, "Input ", config_.input_url, " read failed: ", errbuf, ", reconnecting...");
+                stalled_since = 0;
+                if (!reconnect_input()) break;
+                continue;
             }
-            if (ret == AVERROR(ETIMEDOUT)) {
-                g_logger.log(LOG_ERROR, "read timeout"+std::to_string(ii));
-                std::cout << "timeout in av read frame ret=" << ret << "ii=" <<ii <<std::endl;
-                std::this_thread::sleep_for(1ms); 
+            stalled_since = 0;
+
+            if (packet->stream_index != video_stream_index_) {
+                av_packet_unref(packet);
                 continue;
             }
+            track_input_packet(packet);
 
-            if (ret == AVERROR_EXIT) {
-                g_logger.log(LOG_WARNING, "av_read_frame timeout,,,.");
+            if (passthrough_) {
+                relay_packet(packet);
+                av_packet_unref(packet);
                 continue;
             }
 
-            if (ret == AVERROR(EAGAIN)) {
-                std::this_thread::sleep_for(10ms);
-                if (retry_num >= 10) {
-                    g_logger.log(LOG_ERROR, "Input error ------------, reconnecting...,after retry_num="+std::to_string(retry_num));
-                    avformat_close_input(&input_ctx_);
-                    while (!init_input() && !should_stop_) {
-                        g_logger.log(LOG_ERROR, "init_input try----------, reconnecting...,after retry_num="+std::to_string(retry_num));
-                        std::this_thread::sleep_for(30ms);
-                    }
-                    retry_num = 0;
-                }
+            AVPacket* ref = av_packet_alloc();
+            if (!ref) {
+                av_packet_unref(packet);
                 continue;
             }
-            if (ret < 0) {
-                ERROR_STR(ret);
-                g_logger.log(LOG_ERROR, "Input error, reconnecting...");
-                avformat_close_input(&input_ctx_);
-                while (!init_input() && !should_stop_) {
-                    std::this_thread::sleep_for(5s);
-                }
+            packet->opaque = reinterpret_cast<void*>(static_cast<intptr_t>(now_us()));
+            av_packet_move_ref(ref, packet);
+            if (decoder_ctx_) {
+                // Compressed packets can't be dropped without breaking references, back-pressure the socket instead
+                if (!packet_queue_.push_wait(ref)) av_packet_free(&ref);
+            } else if (!packet_queue_.push(ref)) {
+                // A raw picture stands alone, drop it rather than stall the reader
+                av_packet_free(&ref);
+                dropped_frames_++;
+            }
+        }
+
+        av_packet_free(&packet);
+        packet_queue_.wake_and_quit();
+        threads_running_--;
+
+        g_logger.log(LOG_INFO, "Demux thread (RTSP) stopped");
+    }
+
+    // Raw RTSP input: the packet is one picture, copy it (transformed if
+    // configured) into a pooled frame
+    void convert_raw_packet(const AVPacket* packet) {
+        uint8_t* src_data[4] = {};
+        int src_linesize[4] = {};
+        if (packet->size < raw_picture_size_ ||
+            av_image_fill_arrays(src_data, src_linesize, packet->data, v4l2_pix_fmt_,
+                                 v4l2_width_, v4l2_height_, 1) < 0) {
+            g_logger.log(LOG_ERROR, "Failed to fill image arrays");
+            return;
+        }
+
+        // The packet is gone after this, copy the picture into a pooled buffer
+        AVFrame* frame = frame_pool_.get_buffered();
+        if (!frame) {
+            g_logger.log(LOG_ERROR, "Failed to get a frame from the pool");
+            return;
+        }
+        if (transforms_picture()) {
+            // Fused into the copy this path makes anyway
+            int64_t start_us = now_us();
+            transform_picture(frame->data, frame->linesize, src_data, src_linesize,
+                              v4l2_pix_fmt_, v4l2_width_, v4l2_height_, config_.rotation, config_.hflip);
+            latency_[STAGE_TRANSFORM].record(now_us() - start_us);
+        } else {
+            av_image_copy(frame->data, frame->linesize, const_cast<const uint8_t**>(src_data), src_linesize,
+                          v4l2_pix_fmt_, v4l2_width_, v4l2_height_);
+        }
+
+        frame->pts = av_rescale_q(frame_count_++, raw_frame_duration_, input_time_base_);
+        stamp_captured(frame);
+        int64_t read_us = reinterpret_cast<intptr_t>(packet->opaque);
+        if (read_us) latency_[STAGE_DECODE].record(now_us() - read_us);
+
+        LOGF(LOG_DEBUG, "Captured frame PTS: ", frame->pts);
+
+        deliver_frame(frame);
+        frame_pool_.put(frame);
+    }
+
+    // Process thread of RTSP inputs: decodes compressed packets, copies raw
+    // pictures. Runs concurrently with the demux thread and never touches
+    // input_ctx_, which the demux thread may be reopening.
+    void process_loop() {
+        ThreadScope scope("process", config_.input_url);
+        AVFrame* frame = av_frame_alloc();
+
+        g_logger.log(LOG_INFO, "Process thread started");
+
+        while (!should_stop_) {
+            AVPacket* pkt = packet_queue_.pop();
+            if (!pkt) break;
+
+            if (!decoder_ctx_) {
+                if (pkt->data) convert_raw_packet(pkt);
+                av_packet_free(&pkt);
                 continue;
             }
 
-            retry_num=0;
-    
-            if (packet->stream_index == video_stream_index_) {
-                AVStream* stream = input_ctx_->streams[video_stream_index_];
-                
-                frame->width = stream->codecpar->width;
-                frame->height = stream->codecpar->height;
-                frame->format = stream->codecpar->format;
-                
-                if (av_image_fill_arrays(frame->data, frame->linesize,
-                                       packet->data,
-                                       static_cast<AVPixelFormat>(frame->format),
-                                       frame->width, frame->height, 1) < 0) {
-                    g_logger.log(LOG_ERROR, "Failed to fill image arrays");
-                    continue;
-                }
+            bool flush = !pkt->data;
+            if (!flush) {
+                DecodeStamp& stamp = decode_stamps_[static_cast<uint64_t>(pkt->pts) % kDecodeSlots];
+                stamp.pts = pkt->pts;
+                stamp.read_us = reinterpret_cast<intptr_t>(pkt->opaque);
+            }
 
-                AVRational input_rate = stream->avg_frame_rate.den > 0 ? 
-                                        stream->avg_frame_rate : 
-                                        stream->r_frame_rate;
-                
-                if (input_rate.den == 0 || input_rate.num == 0) {
-                    input_rate = (AVRational){25, 469}; // num=25, den=469
-                }
-                
-                AVRational time_base = (AVRational){input_rate.num, input_rate.den};
-                frame->pts = av_rescale_q(frame_count_++, time_base, stream->time_base);
+            int ret = avcodec_send_packet(decoder_ctx_, flush ? nullptr : pkt);
+            av_packet_free(&pkt);
+            if (ret < 0 && ret != AVERROR(EAGAIN)) {
+                ERROR_STR(ret);
+                LOGF(LOG_WARNING, "Error sending packet to decoder: ", errbuf);
+            }
 
-                auto capture_us = duration_cast<microseconds>(
-                    high_resolution_clock::now() - capture_start).count();
-                
-                g_logger.log(LOG_DEBUG, std::string("Captured frame PTS: ") + std::to_string(frame->pts) + 
-                          " | Capture time: " + std::to_string(capture_us) + "us");
-
-                if (config_.enable_filter) {
-                    g_logger.log(LOG_INFO, "Processing frame with filter");
-                    process_with_filter(frame, filtered_frame);
-                } else {
-
-				    AVFrame* new_frame = av_frame_clone(frame); 
-                    if (!new_frame) {
-                        g_logger.log(LOG_ERROR, "Failed to clone filtered frame");
-                        continue;
-                    }
-					frame_queue_.push(new_frame);
-					
-                }
+            while ((ret = avcodec_receive_frame(decoder_ctx_, frame)) >= 0) {
+                on_decoded_frame(frame);
+                av_frame_unref(frame);
+            }
+            if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+                ERROR_STR(ret);
+                LOGF(LOG_ERROR, "Error decoding frame: ", errbuf);
+            }
+
+            if (flush) {
+                // The next input session starts a new stream, timestamps included
+                avcodec_flush_buffers(decoder_ctx_);
+                decode_pts_offset_ = AV_NOPTS_VALUE;
             }
-            av_packet_unref(packet);
         }
 
-        av_packet_free(&packet);
-        av_frame_free(&frame);
-        av_frame_free(&filtered_frame);
+        av_frame_free(&frame);
+        rate_converter_.reset();
+        frame_queue_.wake_and_quit();
+        threads_running_--;
+
+        g_logger.log(LOG_INFO, "Process thread stopped");
+    }
+
+    void on_decoded_frame(AVFrame* frame) {
+        int64_t pts = frame->best_effort_timestamp;
+        const DecodeStamp& stamp = decode_stamps_[static_cast<uint64_t>(pts) % kDecodeSlots];
+        if (pts != AV_NOPTS_VALUE && stamp.pts == pts && stamp.read_us) {
+            latency_[STAGE_DECODE].record(now_us() - stamp.read_us);
+        }
+
+        frame->format = decoded_format(static_cast<AVPixelFormat>(frame->format));
+        if (frame->width != v4l2_width_ || frame->height != v4l2_height_ || frame->format != v4l2_pix_fmt_) {
+            LOGF(LOG_WARNING, "Dropping decoded frame, stream changed to ", frame->width, "x", frame->height);
+            return;
+        }
+
+        // Keep pts monotonic across input reconnects, the rate converter and encoder expect it
+        if (pts == AV_NOPTS_VALUE) {
+            pts = decode_last_pts_ == AV_NOPTS_VALUE ? 0 : decode_last_pts_ + 1;
+        }
+        if (decode_pts_offset_ == AV_NOPTS_VALUE) {
+            decode_pts_offset_ = decode_last_pts_ == AV_NOPTS_VALUE ? 0 : decode_last_pts_ + 1 - pts;
+        }
+        pts += decode_pts_offset_;
+        if (decode_last_pts_ != AV_NOPTS_VALUE && pts <= decode_last_pts_) {
+            pts = decode_last_pts_ + 1;
+        }
+        decode_last_pts_ = pts;
+        frame->pts = pts;
+
+        stamp_captured(frame);
+        if (!transform_frame(frame)) return;
+        deliver_frame(frame);
+    }
+
+    // V4L2 capture has no thread of its own: the CaptureReactor waits on every
+    // device's fd and calls on_v4l2_readable() when a buffer is ready and
+    // on_v4l2_tick() after each wakeup to run the timeout/reinit logic.
+    static constexpr auto kV4L2Timeout = 50ms;
+    static constexpr int kV4L2MaxRetries = 3;
+
+    void v4l2_capture_begin() {
+        v4l2_frame_ = av_frame_alloc();
+        v4l2_on_reactor_ = true;
+        v4l2_retry_count_ = 0;
+        v4l2_deadline_ = steady_clock::now() + kV4L2Timeout;
+
+        g_logger.log(LOG_INFO, "Capture started (V4L2 MPlane): " + config_.input_url);
+    }
+
+    void v4l2_capture_end() {
+        for (AVFrame* held : v4l2_held_) frame_pool_.put(held);
+        v4l2_held_.clear();
+        av_frame_free(&v4l2_frame_);
+        rate_converter_.reset();
+        cleanup_v4l2_buffers();
         frame_queue_.wake_and_quit();
-        
-        g_logger.log(LOG_INFO, "Capture thread (RTSP) stopped");
+        threads_running_--;
+
+        g_logger.log(LOG_INFO, "Capture stopped (V4L2 MPlane): " + config_.input_url);
     }
 
-    void capture_loop_v4l2() {
-        AVFrame* frame = av_frame_alloc();
-        AVFrame* filtered_frame = av_frame_alloc();
-        struct v4l2_buffer buf = {};
-        struct v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+    // Fd the reactor should watch, -1 while the device is down, stopping or
+    // waiting for room in the frame queue
+    int v4l2_watch_fd() const {
+        if (should_stop_ || v4l2_needs_reinit_ || !v4l2_streaming_ || !v4l2_held_.empty()) return -1;
+        return v4l2_fd_;
+    }
 
-        g_logger.log(LOG_INFO, "Capture thread started (V4L2 MPlane)");
+    // The reactor polls more often while a device waits for the encoder
+    bool v4l2_waiting_for_room() const { return !v4l2_held_.empty(); }
 
-        const int max_retries = 3;
-        int retry_count = 0;
-        bool needs_reinit = false;
+    // Bumped whenever the device is reopened, so a recycled fd number is re-registered
+    uint64_t v4l2_open_count() const { return v4l2_open_count_; }
 
-        while (!should_stop_) {
-            auto capture_start = high_resolution_clock::now();
+    void on_v4l2_error() {
+        LOGF(LOG_ERROR, "V4L2 poll error on ", config_.input_url);
+        v4l2_needs_reinit_ = true;
+    }
 
-            if (needs_reinit) {
-                cleanup_v4l2_buffers();
-                close(v4l2_fd_);
-                v4l2_fd_ = -1;
+    void on_v4l2_tick(steady_clock::time_point now) {
+        if (should_stop_) return;
 
-                if (init_input()) {
-                    needs_reinit = false;
-                    retry_count = 0;
-                    g_logger.log(LOG_INFO, "V4L2 device reinitialized successfully");
-                } else {
-                    g_logger.log(LOG_ERROR, "Failed to reinitialize V4L2 device, retrying in 1 second...");
-                    std::this_thread::sleep_for(1s);
-                    continue;
-                }
+        if (v4l2_requeue_failed_) {
+            v4l2_needs_reinit_ = true;
+        }
+
+        if (v4l2_needs_reinit_) {
+            if (now < v4l2_next_reinit_) return;
+
+            cleanup_v4l2_buffers();
+            close(v4l2_fd_);
+            v4l2_fd_ = -1;
+
+            if (init_input()) {
+                v4l2_needs_reinit_ = false;
+                v4l2_retry_count_ = 0;
+                v4l2_deadline_ = now + kV4L2Timeout;
+                g_logger.log(LOG_INFO, "V4L2 device reinitialized successfully: " + config_.input_url);
+            } else {
+                // Other devices on the reactor keep running, retry on a later tick
+                g_logger.log(LOG_ERROR, "Failed to reinitialize V4L2 device " + config_.input_url +
+                          ", retrying in 1 second...");
+                v4l2_next_reinit_ = now + 1s;
             }
+            return;
+        }
 
-            fd_set fds;
-            FD_ZERO(&fds);
-            FD_SET(v4l2_fd_, &fds);
+        if (now >= window_end_) {
+            check_v4l2_drops(now);
+        }
 
-            struct timeval tv = {};
-            tv.tv_sec = 0;  // 2 second timeout
-            tv.tv_usec = 50000;
+        // Not reading the device on purpose, that is no timeout
+        while (!v4l2_held_.empty() && frame_queue_.push(v4l2_held_.front())) {
+            v4l2_held_.pop_front();
+        }
+        if (!v4l2_held_.empty()) {
+            v4l2_deadline_ = now + kV4L2Timeout;
+            return;
+        }
 
-            int ret = select(v4l2_fd_ + 1, &fds, NULL, NULL, &tv);
-            if (ret == -1) {
-                g_logger.log(LOG_ERROR, "V4L2 select error: " + std::string(strerror(errno)));
-                needs_reinit = true;
-                continue;
+        if (now >= v4l2_deadline_) {
+            LOGF(LOG_WARNING, "V4L2 timeout on ", config_.input_url, ", retry_count", v4l2_retry_count_,
+                 ", buffers loaned ", v4l2_loaned_.load(), "/", v4l2_buffers_.size());
+            v4l2_deadline_ = now + kV4L2Timeout;
+            if (++v4l2_retry_count_ >= kV4L2MaxRetries) {
+                g_logger.log(LOG_ERROR, "Max V4L2 timeouts reached, reinitializing " + config_.input_url);
+                v4l2_needs_reinit_ = true;
             }
-            if (ret == 0) {
-                g_logger.log(LOG_WARNING, "V4L2 select timeout, retry_count"+std::to_string(retry_count));
-                if (++retry_count >= max_retries) {
-                    g_logger.log(LOG_ERROR, "Max select timeouts reached, reinitializing V4L2 device");
-                    needs_reinit = true;
-                }
-                continue;
+        }
+    }
+
+    // PTS from the driver's capture timestamp, in microseconds since the first
+    // frame. It follows the real sensor cadence, so the rate converter converts
+    // the actual rate instead of an assumed one. The timestamp is on the
+    // CLOCK_MONOTONIC timeline now_us() uses, so it also becomes the frame's
+    // origin for absolute capture-to-send latency.
+    int64_t v4l2_pts(const struct v4l2_buffer& buf, FrameStamps& stamps) {
+        int64_t capture_us = stamps.dequeue_us;
+        if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+            int64_t sensor_us = static_cast<int64_t>(buf.timestamp.tv_sec) * 1000000 + buf.timestamp.tv_usec;
+            if (sensor_us > 0 && sensor_us <= stamps.dequeue_us) {
+                capture_us = sensor_us;
+                latency_[STAGE_SENSOR].record(stamps.dequeue_us - sensor_us);
             }
+        } else if (!v4l2_warned_timestamp_) {
+            v4l2_warned_timestamp_ = true;
+            g_logger.log(LOG_WARNING, "V4L2 driver gives no monotonic timestamps for " + config_.input_url +
+                      ", using dequeue time");
+        }
+        stamps.origin_us = capture_us;
 
-            // Dequeue buffer
-            memset(&buf, 0, sizeof(buf));
-            memset(planes, 0, sizeof(planes));
-            
-            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-            buf.memory = V4L2_MEMORY_MMAP;
-            buf.length = VIDEO_MAX_PLANES;
-            buf.m.planes = planes;
+        // The clock keeps running across device reinits, so one origin serves them all
+        if (v4l2_pts_origin_ == AV_NOPTS_VALUE) v4l2_pts_origin_ = capture_us;
+        int64_t pts = capture_us - v4l2_pts_origin_;
+        if (v4l2_last_pts_ != AV_NOPTS_VALUE && pts <= v4l2_last_pts_) {
+            pts = v4l2_last_pts_ + 1;
+        }
+        v4l2_last_pts_ = pts;
+        return pts;
+    }
 
-            if (ioctl(v4l2_fd_, VIDIOC_DQBUF, &buf) < 0) {
-                g_logger.log(LOG_ERROR, "Failed to dequeue V4L2 buffer: " + std::string(strerror(errno)));
-                needs_reinit = true;
-                continue;
+    // Called per dequeued buffer, before it is loaned out
+    void track_v4l2_sequence(const struct v4l2_buffer& buf) {
+        uint32_t gap = 0;
+        if (v4l2_have_sequence_) {
+            gap = buf.sequence - v4l2_last_sequence_ - 1;  // unsigned, wraps correctly
+            if (gap > 0) {
+                v4l2_driver_drops_.fetch_add(gap, std::memory_order_relaxed);
+                LOGF(LOG_DEBUG, "V4L2 sequence gap on ", config_.input_url, ": ", gap, " frames before ", buf.sequence);
             }
+        }
+        v4l2_have_sequence_ = true;
+        v4l2_last_sequence_ = buf.sequence;
+        v4l2_sensor_frames_.fetch_add(gap + 1, std::memory_order_relaxed);
+        window_frames_ += gap + 1;
+        window_drops_ += gap;
+
+        // This buffer is about to be loaned, count what the driver has left to fill
+        if (v4l2_loaned_.load() + 1 >= static_cast<int>(v4l2_buffers_.size())) {
+            v4l2_starved_.fetch_add(1, std::memory_order_relaxed);
+            window_starved_++;
+        }
+    }
 
-            // Reset retry count on successful capture
-            retry_count = 0;
+    // Once per kDropWindow: grow req.count when drops are sustained and caused by buffer starvation
+    void check_v4l2_drops(steady_clock::time_point now) {
+        bool sustained = window_frames_ > 0 && window_drops_ * 100 >= window_frames_ * kDropPercent;
+        if (sustained) {
+            LOGF(LOG_WARNING, "V4L2 driver dropped ", window_drops_, " of ", window_frames_, " frames on ",
+                 config_.input_url, ", starved ", window_starved_, " times");
+        }
 
-            // Prepare AVFrame
-            av_frame_unref(frame);
-            frame->width = v4l2_width_;
-            frame->height = v4l2_height_;
-            frame->format = v4l2_pix_fmt_;
-            // frame->pts = frame_count_++;
-            AVRational input_time_base = {1, static_cast<int>(config_.input_fps)};
-            frame->pts = av_rescale_q(frame_count_++, 
-                                    input_time_base, 
-                                    input_time_base);
-
-
-            // For MPlane, we need to set data and linesize for each plane
-            for (int i = 0; i < 1; i++) {
-                frame->data[i] = static_cast<uint8_t*>(v4l2_buffers_[buf.index].start[i]) + planes[i].data_offset;
-                frame->linesize[i] = v4l2_buffers_[buf.index].bytesperline[i];
-            }
-            frame->data[1] = frame->data[0] + (v4l2_buffers_[buf.index].bytesperline[0] * v4l2_height_);
-            frame->linesize[1] = v4l2_buffers_[buf.index].bytesperline[0]; // testing
-
-            auto capture_us = duration_cast<microseconds>(
-                high_resolution_clock::now() - capture_start).count();
-            
-            g_logger.log(LOG_DEBUG, std::string("Captured frame PTS: ") + std::to_string(frame->pts) + 
-                      " | Capture time: " + std::to_string(capture_us) + "us");
+        if (!sustained) {
+            sustained_drop_windows_ = 0;
+        } else if (window_starved_ == 0) {
+            // Every dequeue left the driver a free buffer, the frames are lost before the queue
+            sustained_drop_windows_ = 0;
+            LOGF(LOG_WARNING, "Drops on ", config_.input_url, " are upstream of the buffer queue, not raising buffer count");
+        } else if (++sustained_drop_windows_ >= kSustainedWindows && v4l2_buffer_count_ < kMaxV4L2Buffers) {
+            v4l2_buffer_count_ = std::min(v4l2_buffer_count_.load() + 2, kMaxV4L2Buffers);
+            sustained_drop_windows_ = 0;
+            g_logger.log(LOG_WARNING, "Sustained V4L2 drops on " + config_.input_url +
+                      ", reinitializing with " + std::to_string(v4l2_buffer_count_.load()) + " buffers");
+            v4l2_needs_reinit_ = true;
+        }
 
-            if (config_.enable_filter) {
-                g_logger.log(LOG_DEBUG, "Processing frame with filter");
-                process_with_filter(frame, filtered_frame);
-            } else {
+        window_frames_ = 0;
+        window_drops_ = 0;
+        window_starved_ = 0;
+        window_end_ = now + kDropWindow;
+    }
 
-	        AVFrame* new_frame = av_frame_clone(frame); 
-                if (!new_frame) {
-                    g_logger.log(LOG_ERROR, "Failed to clone filtered frame");
-                    continue;
-                }
-				
-                AVRational encoder_time_base = encoder_ctx_->time_base;
-                new_frame->pts = av_rescale_q(new_frame->pts, 
-                                            input_time_base, 
-                                            encoder_time_base);
-			    
-				frame_queue_.push(new_frame);
-            }
+    void on_v4l2_readable() {
+        if (should_stop_ || v4l2_needs_reinit_) return;
 
-            // Requeue the buffer
+        auto capture_start = high_resolution_clock::now();
+        AVFrame* frame = v4l2_frame_;
+        struct v4l2_buffer buf = {};
+        struct v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+
+        // Dequeue buffer
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.length = VIDEO_MAX_PLANES;
+        buf.m.planes = planes;
+
+        if (ioctl(v4l2_fd_, VIDIOC_DQBUF, &buf) < 0) {
+            if (errno == EAGAIN) return;
+            LOGF(LOG_ERROR, "Failed to dequeue V4L2 buffer: ", strerror(errno));
+            v4l2_needs_reinit_ = true;
+            return;
+        }
+
+        // Reset retry count on successful capture
+        v4l2_retry_count_ = 0;
+        v4l2_deadline_ = steady_clock::now() + kV4L2Timeout;
+        track_v4l2_sequence(buf);
+
+        // Prepare AVFrame
+        av_frame_unref(frame);
+        stamp_captured(frame);
+        frame->width = v4l2_width_;
+        frame->height = v4l2_height_;
+        frame->format = v4l2_pix_fmt_;
+        frame->pts = v4l2_pts(buf, stamps_of(frame));
+
+        // Hand the mmap'd buffer out by reference, it is requeued when the last frame using it is freed
+        frame->buf[0] = loan_v4l2_buffer(buf.index);
+        if (!frame->buf[0]) {
+            g_logger.log(LOG_ERROR, "Failed to wrap V4L2 buffer");
             if (ioctl(v4l2_fd_, VIDIOC_QBUF, &buf) < 0) {
-                g_logger.log(LOG_ERROR, "Failed to requeue V4L2 buffer: " + std::string(strerror(errno)));
-                needs_reinit = true;
-                continue;
+                v4l2_needs_reinit_ = true;
             }
+            return;
         }
 
-        // Cleanup
-        cleanup_v4l2_buffers();
-        av_frame_free(&frame);
-        av_frame_free(&filtered_frame);
-        frame_queue_.wake_and_quit();
-        
-        g_logger.log(LOG_INFO, "Capture thread (V4L2 MPlane) stopped");
-    }
+        // For MPlane, we need to set data and linesize for each plane
+        for (int i = 0; i < 1; i++) {
+            frame->data[i] = static_cast<uint8_t*>(v4l2_buffers_[buf.index]->start[i]) + planes[i].data_offset;
+            frame->linesize[i] = v4l2_buffers_[buf.index]->bytesperline[i];
+        }
+        frame->data[1] = frame->data[0] + (v4l2_buffers_[buf.index]->bytesperline[0] * v4l2_height_);
+        frame->linesize[1] = v4l2_buffers_[buf.index]->bytesperline[0]; // testing
 
-    void process_with_filter(AVFrame* frame, AVFrame* filtered_frame) {
-        auto filter_start = high_resolution_clock::now();
+        auto capture_us = duration_cast<microseconds>(
+            high_resolution_clock::now() - capture_start).count();
         
-        if (av_buffersrc_add_frame(buffersrc_ctx_, frame) < 0) {
-            g_logger.log(LOG_ERROR, "Error feeding frame to filter");
+        LOGF(LOG_DEBUG, "Captured frame PTS: ", frame->pts, " | Capture time: ", capture_us, "us",
+             " | Loaned: ", v4l2_loaned_.load());
+
+        if (!transform_frame(frame)) {
+            av_frame_unref(frame);
             return;
         }
 
-        while (true) {
-            int ret = av_buffersink_get_frame(buffersink_ctx_, filtered_frame);
-            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) { 
-                break;
-            }
-            
-            if (ret < 0) {
-                ERROR_STR(ret);
-                g_logger.log(LOG_ERROR, "Error getting filtered frame");
-                break;
-            }
+        // Moves our reference to the V4L2 buffer on, no pixel copy
+        deliver_frame(frame);
 
-            auto filter_us = duration_cast<microseconds>(
-                high_resolution_clock::now() - filter_start).count();
-            
-            g_logger.log(LOG_DEBUG, std::string("Filtered frame PTS: ") + std::to_string(filtered_frame->pts) +
-                      " | Filter time: " + std::to_string(filter_us) + "us");
+        // Drop whatever reference is left, the buffer goes back to the driver once the encoder is done with it
+        av_frame_unref(frame);
+    }
 
-			AVFrame* new_frame = av_frame_clone(filtered_frame);
-            if (!new_frame) {
-                g_logger.log(LOG_ERROR, "Failed to clone filtered frame");
-                av_frame_unref(filtered_frame);
-                continue;
-            }
-			
-			
-            frame_queue_.push(new_frame);
-            av_frame_unref(filtered_frame);
+    void drop_frame(AVFrame* frame) {
+        frame_pool_.put(frame);
+        uint64_t drops = ++dropped_frames_;
+
+        // Rate limited, under latest-wins dropping is the normal case
+        auto now = steady_clock::now();
+        if (now - last_drop_log_ >= 1s) {
+            last_drop_log_ = now;
+            LOGF(LOG_WARNING, "Frame queue overloaded, total dropped frames: ", drops);
+        }
+    }
+
+    // Capture side of frame_queue_, takes ownership of the frame
+    void enqueue_frame(AVFrame* frame) {
+        stamps_of(frame).enqueue_us = now_us();
+
+        switch (config_.queue_policy) {
+            case QUEUE_LATEST_WINS:
+                while (AVFrame* stale = frame_queue_.steal_oldest()) {
+                    drop_frame(stale);
+                }
+                if (!frame_queue_.push(frame)) drop_frame(frame);
+                break;
+            case QUEUE_BLOCK:
+                // The reactor serves other devices too, it must not park here
+                if (v4l2_on_reactor_) {
+                    if (!v4l2_held_.empty() || !frame_queue_.push(frame)) v4l2_held_.push_back(frame);
+                } else if (!frame_queue_.push_blocking(frame)) {
+                    frame_pool_.put(frame);
+                }
+                break;
+            case QUEUE_DROP_OLDEST:
+            default:
+                while (!frame_queue_.push(frame)) {
+                    AVFrame* stale = frame_queue_.steal_oldest();
+                    if (stale) drop_frame(stale);
+                }
+                break;
         }
     }
 
     void encode_loop() {
+        ThreadScope scope("encode", config_.input_url);
         AVPacket* pkt = av_packet_alloc();
         g_logger.log(LOG_INFO, "Encode thread started");
 
@@ -934,17 +5121,42 @@ private:
             AVFrame* frame = frame_queue_.pop();
             if (!frame) continue;
 
+            adapt_bitrate();
+            if (bitrate_controller_.skip_frame()) {
+                frame_pool_.put(frame);
+                continue;
+            }
+
             auto encode_start = high_resolution_clock::now();
+            const FrameStamps& stamps = stamps_of(frame);
+            int64_t encode_in_us = now_us();
+            latency_[STAGE_QUEUE].record(encode_in_us - stamps.enqueue_us);
+
+            EncodeStamp& in_stamp = encode_stamps_[static_cast<uint64_t>(frame->pts) % kEncodeSlots];
+            in_stamp.pts = frame->pts;
+            in_stamp.origin_us = stamps.origin_us;
+            in_stamp.encode_in_us = encode_in_us;
+
+            // A reconnected output restarts at the next keyframe, ask for one now
+            bool force_keyframe = false;
+            for (auto& sink : sinks_) {
+                force_keyframe |= sink->take_keyframe_request();
+            }
+            if (force_keyframe) {
+                frame->pict_type = AV_PICTURE_TYPE_I;
+                LOGF(LOG_INFO, "Forcing keyframe at PTS ", frame->pts, " for a reconnected output");
+            }
+
             int ret = avcodec_send_frame(encoder_ctx_, frame);
             
             if (ret == AVERROR(EAGAIN)) {
-                av_frame_free(&frame);
+                frame_pool_.put(frame);
                 continue;
             }
             if (ret < 0) {
                 ERROR_STR(ret);
-                g_logger.log(LOG_ERROR, std::string("Error sending frame: ") + errbuf);
-                av_frame_free(&frame);
+                LOGF(LOG_ERROR, "Error sending frame: ", errbuf);
+                frame_pool_.put(frame);
                 continue;
             }
 
@@ -954,58 +5166,55 @@ private:
                 if (ret == AVERROR_EOF) break;
                 if (ret < 0) {
                     ERROR_STR(ret);
-                    g_logger.log(LOG_ERROR, std::string("Error encoding frame: ") + errbuf);
+                    LOGF(LOG_ERROR, "Error encoding frame: ", errbuf);
                     break;
                 }
 
+                // Look up the frame by pts before it gets patched and rescaled below
+                const EncodeStamp& out_stamp = encode_stamps_[static_cast<uint64_t>(pkt->pts) % kEncodeSlots];
+                int64_t packet_origin_us = 0;
+                if (out_stamp.pts == pkt->pts) {
+                    latency_[STAGE_ENCODE].record(now_us() - out_stamp.encode_in_us);
+                    packet_origin_us = out_stamp.origin_us;
+                }
+
+                // Packets stay in the encoder time base, each sink rescales to its own stream
                 if (last_pts_ != AV_NOPTS_VALUE && pkt->pts <= last_pts_) {
-                    pkt->pts = last_pts_ + av_rescale_q(1, encoder_ctx_->time_base,
-                                                     output_ctx_->streams[0]->time_base);
+                    pkt->pts = last_pts_ + 1;
                 }
                 last_pts_ = pkt->pts; 
 
-                pkt->stream_index = 0;
-                av_packet_rescale_ts(pkt, encoder_ctx_->time_base,
-                                   output_ctx_->streams[0]->time_base);
-
                 auto encoded_us = duration_cast<microseconds>(
                     high_resolution_clock::now() - encode_start).count();
                 
-                g_logger.log(LOG_DEBUG, std::string("Encoded packet PTS: ") + std::to_string(pkt->pts) +
-                          " | Encode time: " + std::to_string(encoded_us) + "us");
-
-                auto send_start = high_resolution_clock::now();
-                ret = av_interleaved_write_frame(output_ctx_, pkt);
-                auto send_us = duration_cast<microseconds>(
-                    high_resolution_clock::now() - send_start).count();
+                LOGF(LOG_DEBUG, "Encoded packet PTS: ", pkt->pts, " | Encode time: ", encoded_us, "us");
 
-                if (ret < 0) {
-                    ERROR_STR(ret);
-                    g_logger.log(LOG_ERROR, std::string("Error writing packet: ") + errbuf);
-                    // Retry
-                    avformat_free_context(output_ctx_);
-                    output_ctx_ = nullptr;
-                    while (!init_output() && !should_stop_) {
-                        std::this_thread::sleep_for(5s);
-                    }
-                    break;
+                // Encode once, every output gets a reference to the same packet data
+                pkt->opaque = reinterpret_cast<void*>(static_cast<intptr_t>(packet_origin_us));
+                for (auto& sink : sinks_) {
+                    sink->send(pkt);
                 }
-                
-                g_logger.log(LOG_DEBUG, std::string("Sent packet PTS: ") + std::to_string(pkt->pts) +
-                          " | Send time: " + std::to_string(send_us) + "us");
+                encoded_packets_.fetch_add(1, std::memory_order_relaxed);
                 
                 av_packet_unref(pkt);
             }
-            av_frame_free(&frame);
+            // The encoder holds its own reference if it still needs the pixels
+            frame_pool_.put(frame);
         }
 
         av_packet_free(&pkt);
+        threads_running_--;
         g_logger.log(LOG_INFO, "Encode thread stopped");
     }
 
     void cleanup() {
         g_logger.log(LOG_INFO, "Cleaning up resources...");
-        
+
+        // Release queued and held frames first, they may still hold V4L2 buffers
+        packet_queue_.drain();
+        frame_queue_.drain();
+        rate_converter_.reset();
+
         cleanup_v4l2_buffers();
         
         if (v4l2_fd_ >= 0) {
@@ -1013,57 +5222,508 @@ private:
             v4l2_fd_ = -1;
         }
         
+        if (decoder_ctx_) avcodec_free_context(&decoder_ctx_);
         if (encoder_ctx_) {
             avcodec_close(encoder_ctx_);
             avcodec_free_context(&encoder_ctx_);
         }
 		
         if (input_ctx_) avformat_close_input(&input_ctx_);
-        if (output_ctx_) {
-            if (output_ctx_->pb) avio_closep(&output_ctx_->pb);
-            avformat_free_context(output_ctx_);
+        sinks_.clear();
+        retired_v4l2_buffers_.clear();
+    }
+};
+
+// One thread waits on every V4L2 device with epoll, so N cameras share one
+// capture thread instead of paying for N. Each device still feeds its own
+// encoder pipeline. An eventfd wakes the loop for shutdown.
+class CaptureReactor {
+public:
+    ~CaptureReactor() {
+        if (epoll_fd_ >= 0) close(epoll_fd_);
+        if (shutdown_fd_ >= 0) close(shutdown_fd_);
+    }
+
+    bool init() {
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ < 0) {
+            g_logger.log(LOG_ERROR, "Failed to create epoll instance: " + std::string(strerror(errno)));
+            return false;
+        }
+
+        shutdown_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (shutdown_fd_ < 0) {
+            g_logger.log(LOG_ERROR, "Failed to create shutdown eventfd: " + std::string(strerror(errno)));
+            return false;
+        }
+
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = kShutdownKey;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, shutdown_fd_, &ev) < 0) {
+            g_logger.log(LOG_ERROR, "Failed to watch shutdown eventfd: " + std::string(strerror(errno)));
+            return false;
+        }
+        return true;
+    }
+
+    // Register before start()
+    void add(VideoStreamer* streamer) {
+        sources_.push_back({streamer, -1, 0});
+    }
+
+    bool empty() const { return sources_.empty(); }
+
+    // Written from the signal handler, write() on an eventfd is async-signal-safe
+    int shutdown_fd() const { return shutdown_fd_; }
+
+    void start() {
+        thread_ = std::thread(&CaptureReactor::loop, this);
+    }
+
+    void stop() {
+        uint64_t one = 1;
+        if (write(shutdown_fd_, &one, sizeof(one)) < 0) {
+            g_logger.log(LOG_ERROR, "Failed to signal capture reactor: " + std::string(strerror(errno)));
+        }
+    }
+
+    void join() {
+        if (thread_.joinable()) thread_.join();
+    }
+
+private:
+    static constexpr uint64_t kShutdownKey = 0;
+    static constexpr int kMaxEvents = 16;
+    static constexpr int kTickMs = 10;
+    static constexpr int kHeldTickMs = 1;   // while a device waits for room in its frame queue
+
+    struct Source {
+        VideoStreamer* streamer;
+        int fd;                 // fd currently registered with epoll, -1 if none
+        uint64_t open_count;    // device generation the registration belongs to
+    };
+
+    int epoll_fd_ = -1;
+    int shutdown_fd_ = -1;
+    std::vector<Source> sources_;
+    std::thread thread_;
+
+    // Devices reopen their fd on reinit, keep the epoll set in step
+    void sync_fds() {
+        for (size_t i = 0; i < sources_.size(); i++) {
+            Source& src = sources_[i];
+            int fd = src.streamer->v4l2_watch_fd();
+            uint64_t open_count = src.streamer->v4l2_open_count();
+            if (fd == src.fd && open_count == src.open_count) continue;
+
+            if (src.fd >= 0) {
+                // Fails harmlessly if the old fd was already closed
+                epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, src.fd, nullptr);
+            }
+            src.fd = -1;
+            src.open_count = open_count;
+
+            if (fd >= 0) {
+                struct epoll_event ev = {};
+                ev.events = EPOLLIN;
+                ev.data.u64 = i + 1;
+                if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                    g_logger.log(LOG_ERROR, "Failed to watch V4L2 fd: " + std::string(strerror(errno)));
+                    continue;
+                }
+                src.fd = fd;
+            }
+        }
+    }
+
+    void loop() {
+        ThreadScope scope("capture", "v4l2");
+        g_logger.log(LOG_INFO, "Capture reactor started with " + std::to_string(sources_.size()) + " device(s)");
+        for (Source& src : sources_) {
+            src.streamer->v4l2_capture_begin();
+        }
+
+        struct epoll_event events[kMaxEvents];
+        bool quit = false;
+        while (!quit) {
+            sync_fds();
+
+            int timeout_ms = kTickMs;
+            for (const Source& src : sources_) {
+                if (src.streamer->v4l2_waiting_for_room()) timeout_ms = kHeldTickMs;
+            }
+            int n = epoll_wait(epoll_fd_, events, kMaxEvents, timeout_ms);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                g_logger.log(LOG_ERROR, "epoll_wait failed: " + std::string(strerror(errno)));
+                break;
+            }
+
+            for (int i = 0; i < n; i++) {
+                if (events[i].data.u64 == kShutdownKey) {
+                    quit = true;
+                    continue;
+                }
+                Source& src = sources_[events[i].data.u64 - 1];
+                if (events[i].events & EPOLLIN) {
+                    src.streamer->on_v4l2_readable();
+                } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    src.streamer->on_v4l2_error();
+                }
+            }
+
+            auto now = steady_clock::now();
+            for (Source& src : sources_) {
+                src.streamer->on_v4l2_tick(now);
+            }
         }
-        if (filter_graph_) avfilter_graph_free(&filter_graph_);
-		if (filter_graph_) {
-            avfilter_graph_free(&filter_graph_);
-            buffersrc_ctx_ = nullptr;
-            buffersink_ctx_ = nullptr;
+
+        for (Source& src : sources_) {
+            src.streamer->v4l2_capture_end();
         }
+        g_logger.log(LOG_INFO, "Capture reactor stopped");
     }
 };
 
-int main(int argc, char** argv) {
-    if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " <input_url> <output_url>" << std::endl;
-        std::cerr << "Example: " << argv[0] << " /dev/video0 rtsp://192.168.1.86:8554/live2" << std::endl;
-        return 1;
+static std::atomic<bool> g_stop{false};
+static int g_shutdown_event = -1;
+
+static void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [options] <input_url[,input_url...]> <output_url[,output_url...]> [log_file]" << std::endl;
+    std::cerr << "Example: " << prog << " /dev/video0 rtsp://192.168.1.86:8554/live2" << std::endl;
+    std::cerr << "         " << prog << " /dev/video0,/dev/video2 rtsp://192.168.1.86:8554/live0,rtsp://192.168.1.86:8554/live2" << std::endl;
+    std::cerr << "         " << prog << " /dev/video0 'rtsp://192.168.1.86:8554/live2|/userdata/rec/cam0.ts'" << std::endl;
+    std::cerr << "         " << prog << " /dev/video0 'rtsp-server://0.0.0.0:8554/cam0|/userdata/rec/cam0.ts'" << std::endl;
+    std::cerr << "An output_url may list several outputs separated by '|', the stream is encoded once for all of them." << std::endl;
+    std::cerr << "rtsp-server://[address]:port/path serves viewers directly at rtsp://host:port/path." << std::endl;
+    std::cerr << "rtp://host:port[?ttl=N&localaddr=IP&pkt_size=N&sdp=FILE] sends RTP over UDP, host may be a multicast group." << std::endl;
+    std::cerr << "hls://DIR[?segment=SECONDS&part=SECONDS&window=N] writes low-latency HLS (fMP4) into DIR, a tmpfs for an HTTP server to serve." << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  --queue-depth N          capture->encode queue depth, 1..128 (default 8)" << std::endl;
+    std::cerr << "  --queue-policy POLICY    drop-oldest | latest | block (default drop-oldest)" << std::endl;
+    std::cerr << "  --sink-queue-depth N     encoded packets buffered per output (default 64)" << std::endl;
+    std::cerr << "  --copy                   relay H.264 RTSP inputs without decoding or re-encoding, not mirrored or rotated" << std::endl;
+    std::cerr << "  --decode-threads N       decoder threads for compressed RTSP inputs (default 0, one per core)" << std::endl;
+    std::cerr << "  --v4l2-buffers N         initial V4L2 buffer count, raised on sustained drops (default 4)" << std::endl;
+    std::cerr << "  --no-hflip               don't mirror the picture" << std::endl;
+    std::cerr << "  --rotate DEG             rotate the picture clockwise by 0, 90, 180 or 270 degrees" << std::endl;
+    std::cerr << "  --bitrate KBPS           encoder bitrate, the ceiling with --abr (default 4000)" << std::endl;
+    std::cerr << "  --abr MIN_KBPS           adapt the bitrate to output congestion, down to MIN_KBPS" << std::endl;
+    std::cerr << "  --fast-start             reopen RTSP inputs with minimal probing when their stream parameters are known" << std::endl;
+    std::cerr << "  --param-cache FILE       keep the known stream parameters in FILE across restarts (implies --fast-start)" << std::endl;
+    std::cerr << "  --rtsp-udp               receive RTSP inputs over RTP/UDP, losing frames instead of stalling" << std::endl;
+    std::cerr << "  --jitter-buffer MS       with --rtsp-udp, how long to wait for missing packets (default 80, implies --rtsp-udp)" << std::endl;
+    std::cerr << "  --sync-log               write logs from the calling thread instead of a background writer" << std::endl;
+    std::cerr << "  --affinity ROLE=CPUS     pin a thread role to CPUs, e.g. capture=3 or encode=1-2" << std::endl;
+    std::cerr << "  --sched ROLE=POLICY      fifo:PRIO, rr:PRIO (1-99) or nice:N (-20..19) for a thread role" << std::endl;
+    std::cerr << "  --mlockall               lock memory and prefault heap and thread stacks at startup" << std::endl;
+    std::cerr << "Thread roles: capture (V4L2 reactor, RTSP demux), process (RTSP decode), encode, output (writers)." << std::endl;
+}
+
+static bool parse_queue_policy(const std::string& name, QueuePolicy& policy) {
+    if (name == "drop-oldest") policy = QUEUE_DROP_OLDEST;
+    else if (name == "latest") policy = QUEUE_LATEST_WINS;
+    else if (name == "block") policy = QUEUE_BLOCK;
+    else return false;
+    return true;
+}
+
+// ROLE=VALUE, with ROLE one of ThreadPlacer::kRoles
+static bool parse_thread_option(const std::string& arg, std::string& role, std::string& value) {
+    size_t eq = arg.find('=');
+    if (eq == std::string::npos) return false;
+    role = arg.substr(0, eq);
+    value = arg.substr(eq + 1);
+    for (const char* known : ThreadPlacer::kRoles) {
+        if (role == known) return true;
     }
+    return false;
+}
 
-    avdevice_register_all();
-    avformat_network_init();
+// CPU list in taskset style: 0-1,3
+static bool parse_cpu_list(const std::string& list, std::vector<int>& cpus) {
+    cpus.clear();
+    for (const std::string& range : split_list(list, ',')) {
+        int first = -1, last = -1;
+        if (sscanf(range.c_str(), "%d-%d", &first, &last) == 1) last = first;
+        if (first < 0 || last < first || last >= CPU_SETSIZE) return false;
+        for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+    }
+    return !cpus.empty();
+}
+
+// fifo:PRIO, rr:PRIO or nice:N
+static bool parse_sched(const std::string& value, ThreadPlacement& placement) {
+    size_t colon = value.find(':');
+    if (colon == std::string::npos) return false;
+    std::string policy = value.substr(0, colon);
+    int level = atoi(value.c_str() + colon + 1);
+    if (policy == "fifo" || policy == "rr") {
+        if (level < 1 || level > 99) return false;
+        placement.policy = policy == "fifo" ? SCHED_FIFO : SCHED_RR;
+        placement.priority = level;
+        placement.nice = 0;
+    } else if (policy == "nice") {
+        if (level < -20 || level > 19) return false;
+        placement.policy = SCHED_OTHER;
+        placement.priority = 0;
+        placement.nice = level;
+    } else {
+        return false;
+    }
+    return true;
+}
 
+#ifndef STREAMER_NO_MAIN
+int main(int argc, char** argv) {
     Config config;
-    config.input_url = argv[1];
-    config.output_url = argv[2];
-    config.enable_filter = true;
+    config.convert_rate = true;
+    config.hflip = true;
     config.log_file = "streamer.log";
     config.log_level = LOG_INFO;
     config.console_log = true;
+    config.async_log = true;
+
+    enum { OPT_QUEUE_DEPTH = 256, OPT_QUEUE_POLICY, OPT_SYNC_LOG, OPT_SINK_QUEUE_DEPTH, OPT_COPY, OPT_DECODE_THREADS, OPT_V4L2_BUFFERS, OPT_NO_HFLIP, OPT_ROTATE, OPT_BITRATE, OPT_ABR, OPT_FAST_START, OPT_PARAM_CACHE, OPT_RTSP_UDP, OPT_JITTER_BUFFER, OPT_AFFINITY, OPT_SCHED, OPT_MLOCKALL };
+    static const struct option long_options[] = {
+        {"queue-depth", required_argument, nullptr, OPT_QUEUE_DEPTH},
+        {"queue-policy", required_argument, nullptr, OPT_QUEUE_POLICY},
+        {"sync-log", no_argument, nullptr, OPT_SYNC_LOG},
+        {"sink-queue-depth", required_argument, nullptr, OPT_SINK_QUEUE_DEPTH},
+        {"copy", no_argument, nullptr, OPT_COPY},
+        {"decode-threads", required_argument, nullptr, OPT_DECODE_THREADS},
+        {"v4l2-buffers", required_argument, nullptr, OPT_V4L2_BUFFERS},
+        {"no-hflip", no_argument, nullptr, OPT_NO_HFLIP},
+        {"rotate", required_argument, nullptr, OPT_ROTATE},
+        {"bitrate", required_argument, nullptr, OPT_BITRATE},
+        {"abr", required_argument, nullptr, OPT_ABR},
+        {"fast-start", no_argument, nullptr, OPT_FAST_START},
+        {"param-cache", required_argument, nullptr, OPT_PARAM_CACHE},
+        {"rtsp-udp", no_argument, nullptr, OPT_RTSP_UDP},
+        {"jitter-buffer", required_argument, nullptr, OPT_JITTER_BUFFER},
+        {"affinity", required_argument, nullptr, OPT_AFFINITY},
+        {"sched", required_argument, nullptr, OPT_SCHED},
+        {"mlockall", no_argument, nullptr, OPT_MLOCKALL},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
 
-    if (argc > 3) {
-        config.log_file = argv[3];
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case OPT_QUEUE_DEPTH:
+                config.frame_queue_depth = atoi(optarg);
+                if (config.frame_queue_depth < 1 || config.frame_queue_depth > kMaxFrameQueueDepth) {
+                    std::cerr << "Invalid queue depth: " << optarg << " (1.." << kMaxFrameQueueDepth << ")" << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_QUEUE_POLICY:
+                if (!parse_queue_policy(optarg, config.queue_policy)) {
+                    std::cerr << "Invalid queue policy: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_SYNC_LOG:
+                config.async_log = false;
+                break;
+            case OPT_SINK_QUEUE_DEPTH:
+                config.sink_queue_depth = atoi(optarg);
+                if (config.sink_queue_depth < 1) {
+                    std::cerr << "Invalid sink queue depth: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_COPY:
+                config.passthrough = true;
+                break;
+            case OPT_DECODE_THREADS:
+                config.decode_threads = atoi(optarg);
+                if (config.decode_threads < 0) {
+                    std::cerr << "Invalid decode thread count: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_V4L2_BUFFERS:
+                config.v4l2_buffers = atoi(optarg);
+                if (config.v4l2_buffers < 2 || config.v4l2_buffers > 16) {
+                    std::cerr << "Invalid V4L2 buffer count (2-16): " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_NO_HFLIP:
+                config.hflip = false;
+                break;
+            case OPT_ROTATE:
+                config.rotation = atoi(optarg);
+                if (config.rotation != 0 && config.rotation != 90 && config.rotation != 180 && config.rotation != 270) {
+                    std::cerr << "Invalid rotation: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_BITRATE:
+                config.bitrate = atoll(optarg) * 1000;
+                if (config.bitrate <= 0) {
+                    std::cerr << "Invalid bitrate: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_ABR:
+                config.min_bitrate = atoll(optarg) * 1000;
+                if (config.min_bitrate <= 0) {
+                    std::cerr << "Invalid minimum bitrate: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_FAST_START:
+                config.fast_start = true;
+                break;
+            case OPT_PARAM_CACHE:
+                config.fast_start = true;
+                config.param_cache_file = optarg;
+                break;
+            case OPT_RTSP_UDP:
+                config.rtsp_udp = true;
+                break;
+            case OPT_JITTER_BUFFER:
+                config.rtsp_udp = true;
+                config.jitter_ms = atoi(optarg);
+                if (config.jitter_ms < 1 || config.jitter_ms > 2000) {
+                    std::cerr << "Invalid jitter buffer (1-2000 ms): " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_AFFINITY: {
+                std::string role, cpus;
+                if (!parse_thread_option(optarg, role, cpus) || !parse_cpu_list(cpus, config.threads[role].cpus)) {
+                    std::cerr << "Invalid affinity (ROLE=CPUS): " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            }
+            case OPT_SCHED: {
+                std::string role, policy;
+                if (!parse_thread_option(optarg, role, policy) || !parse_sched(policy, config.threads[role])) {
+                    std::cerr << "Invalid scheduling (ROLE=fifo:PRIO|rr:PRIO|nice:N): " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            }
+            case OPT_MLOCKALL:
+                config.lock_memory = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
     }
 
-    VideoStreamer streamer(config);
-    if (streamer.init() < 0) {
+    if (argc - optind < 2) {
+        usage(argv[0]);
         return 1;
     }
+    if (config.passthrough && config.rotation != 0) {
+        std::cerr << "--copy relays the stream as is and can't be combined with --rotate" << std::endl;
+        return 1;
+    }
+
+    // One pipeline per input, inputs and outputs are paired by position
+    std::vector<std::string> inputs = split_list(argv[optind], ',');
+    std::vector<std::string> outputs = split_list(argv[optind + 1], ',');
+    if (inputs.size() != outputs.size()) {
+        std::cerr << "Need one output_url per input_url (" << inputs.size() << " inputs, "
+                  << outputs.size() << " outputs)" << std::endl;
+        return 1;
+    }
+    if (argc - optind > 2) {
+        config.log_file = argv[optind + 2];
+    }
+
+    avdevice_register_all();
+    avformat_network_init();
+    if (config.rtsp_udp) {
+        av_log_set_callback(rtp_log_callback);
+    }
+    if (!config.param_cache_file.empty()) {
+        g_logger.init(config.log_file, config.log_level, config.console_log, config.async_log);
+        g_stream_params.load(config.param_cache_file);
+    }
+
+    std::vector<std::unique_ptr<VideoStreamer>> streamers;
+    CaptureReactor reactor;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        Config stream_config = config;
+        stream_config.input_url = inputs[i];
+        stream_config.output_url = outputs[i];
+
+        streamers.emplace_back(new VideoStreamer(stream_config));
+        if (streamers.back()->init() < 0) {
+            return 1;
+        }
+        if (!streamers.back()->is_rtsp_source()) {
+            reactor.add(streamers.back().get());
+        }
+    }
 
-    signal(SIGINT, [](int) { exit(0); });
+    if (!reactor.empty()) {
+        if (!reactor.init()) return 1;
+        g_shutdown_event = reactor.shutdown_fd();
+    }
+
+    // First signal asks for a clean shutdown, a second one exits right away
+    auto on_stop = [](int) {
+        if (g_stop.exchange(true)) _exit(0);
+        if (g_shutdown_event >= 0) {
+            uint64_t one = 1;
+            ssize_t ret = write(g_shutdown_event, &one, sizeof(one));
+            (void)ret;
+        }
+    };
+    signal(SIGINT, on_stop);
+    signal(SIGTERM, on_stop);
+    signal(SIGUSR1, [](int) { g_dump_stats = true; });
+
+    // Everything the pipelines preallocate exists by now
+    if (config.lock_memory) ThreadPlacer::lock_memory();
+    g_thread_placer.configure(config.threads, config.lock_memory);
+
+    for (auto& streamer : streamers) {
+        streamer->start();
+    }
+    if (!reactor.empty()) {
+        reactor.start();
+    }
 
-    streamer.run();
+    // The pipeline threads never format stats themselves, dumps happen here
+    auto any_running = [&streamers]() {
+        for (auto& streamer : streamers) {
+            if (streamer->running()) return true;
+        }
+        return false;
+    };
+    while (!g_stop && any_running()) {
+        if (g_dump_stats.exchange(false)) {
+            for (auto& streamer : streamers) streamer->dump_stats();
+            g_thread_placer.dump_stats();
+        }
+        std::this_thread::sleep_for(200ms);
+    }
+
+    for (auto& streamer : streamers) {
+        streamer->stop();
+    }
+    if (!reactor.empty()) {
+        reactor.stop();
+        reactor.join();
+    }
+    for (auto& streamer : streamers) {
+        streamer->join();
+        streamer->dump_stats();
+    }
     return 0;
 }
+#endif
 
 
 /*